@@ -1,15 +1,183 @@
+// pipe2() and accept4() are GNU extensions
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+// the environment of the shell, handed to commands started by the launcher
+extern char **environ;
+
 // a global variable to track FG_only mode
 int FG_only = 0;
 
+// set when running as a command server, where nobody is reading stdout so
+// the messages meant for a user at the prompt are left out
+int serveMode = 0;
+
+/* Self-metrics reported by the metrics builtin. Everything here is updated
+ * inline on the hot path, so recording is a clock read plus a few adds:
+ * latencies go into fixed log-linear ("HDR style") histograms with 8
+ * sub-buckets per power of two, which keeps every value within 12.5% of
+ * its bucket's bounds without ever allocating. */
+
+// sub-buckets per power of two is 1 << HIST_SUB_BITS
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+// the bucket bounds exported to Prometheus, one per power of two from
+// 2^HIST_LADDER_MIN ns (256ns) to 2^HIST_LADDER_MAX ns (about 69s)
+#define HIST_LADDER_MIN 8
+#define HIST_LADDER_MAX 36
+
+/* a latency histogram in nanoseconds
+ * Includes:
+ *			counts[]		observations per bucket, see histIndex()
+ *			count/sum/max	totals over every observation
+ * */
+struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+};
+
+/* the shell's counters
+ * Includes:
+ *			parse			time spent in createInputObject()
+ *			spawn			time from launch request until the PID is known
+ *			wait			time spent waiting for foreground commands
+ *			reap			time spent clearing finished background commands
+ *			parseAllocs/parseAllocBytes	allocations made while parsing
+ *			forkSpawns/zygoteSpawns	commands started by each launch path
+ *			timeouts		commands stopped by their deadline
+ *			bgProcs/bgProcsPeak	background commands currently tracked
+ * */
+struct shellMetrics {
+  struct histogram parse;
+  struct histogram spawn;
+  struct histogram wait;
+  struct histogram reap;
+  uint64_t parseAllocs;
+  uint64_t parseAllocBytes;
+  uint64_t forkSpawns;
+  uint64_t zygoteSpawns;
+  uint64_t timeouts;
+  long bgProcs;
+  long bgProcsPeak;
+};
+
+struct shellMetrics metrics = {0};
+
+// a periodic timerfd and the file the metrics are dumped to when it fires,
+// -1 and NULL while dumping is off
+int metricsDumpFD = -1;
+char *metricsDumpPath = NULL;
+
+// seconds between dumps unless told otherwise
+#define METRICS_DEFAULT_INTERVAL 10.0
+
+// the reporting side is defined further down once everything it reports on
+// has been declared
+void metricsWrite(FILE *out);
+void metricsDump(void);
+
+/******************************************************************************
+ * Function:        nowNs
+ * Description:		reads the monotonic clock
+ * Where:			void
+ * Return:			the current CLOCK_MONOTONIC time in nanoseconds
+ *****************************************************************************/
+uint64_t nowNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/******************************************************************************
+ * Function:        histIndex
+ * Description:		maps a value to its histogram bucket. Values below 8 get
+ *					a bucket each, above that each power of two is split
+ *					into 8 equal sub-buckets.
+ * Where:			uint64_t value - the value to bucket
+ * Return:			the bucket index
+ *****************************************************************************/
+int histIndex(uint64_t value) {
+  if (value < (1 << HIST_SUB_BITS)) {
+    return value;
+  }
+
+  int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) +
+         (int)((value >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/******************************************************************************
+ * Function:        histUpper
+ * Description:		the exclusive upper bound of a histogram bucket, the
+ *					inverse of histIndex()
+ * Where:			int index - the bucket index
+ * Return:			the smallest value in the following bucket
+ *****************************************************************************/
+uint64_t histUpper(int index) {
+  if (index < (1 << HIST_SUB_BITS)) {
+    return index + 1;
+  }
+
+  int shift = (index >> HIST_SUB_BITS) - 1;
+  uint64_t sub = index & ((1 << HIST_SUB_BITS) - 1);
+  return ((1 << HIST_SUB_BITS) + sub + 1) << shift;
+}
+
+/******************************************************************************
+ * Function:        histRecord
+ * Description:		records the time since a starting point in a histogram
+ * Where:			- struct histogram *hist - the histogram to update
+ *					- uint64_t startNs - the starting point from nowNs()
+ * Return:			void
+ *****************************************************************************/
+void histRecord(struct histogram *hist, uint64_t startNs) {
+  uint64_t value = nowNs() - startNs;
+
+  hist->counts[histIndex(value)]++;
+  hist->count++;
+  hist->sum += value;
+  if (value > hist->max) {
+    hist->max = value;
+  }
+}
+
+/******************************************************************************
+ * Function:        parseAlloc
+ * Description:		calloc() for the parser that also counts the allocation
+ *					towards the parse allocation metrics
+ * Where:			- size_t count - the number of elements
+ *					- size_t size - the size of each element
+ * Return:			the zeroed allocation
+ *****************************************************************************/
+void *parseAlloc(size_t count, size_t size) {
+  metrics.parseAllocs++;
+  metrics.parseAllocBytes += count * size;
+  return calloc(count, size);
+}
+
 /******************************************************************************
  * Function:         int count()
  * Description:      counts the number of space separable tokens in a string
@@ -56,38 +224,47 @@ char *expandInput(char inputString[]) {
   sprintf(PIDstr, "%d", PIDint);
   char delim = '$';
 
-  // create a temporary buffer to hold our replacement string
-  char tempStr[2000];
-  memset(tempStr, '\0', 2000 * sizeof(char));
+  // count the $$ pairs first so the replacement can be sized exactly, the
+  // input comes from clients in serve mode and may be as long as they like
+  int pairs = 0;
+  int index = 0;
+  while (inputString[index] != '\0') {
+    if (inputString[index] == delim && inputString[index + 1] == delim) {
+      pairs++;
+      index = index + 2;
+    } else {
+      index++;
+    }
+  }
+
+  // place the expanded string into heap allocated memory so it
+  // can be returned without vanishing
+  char *replacement_buffer;
+  replacement_buffer = parseAlloc(
+      strlen(inputString) + pairs * strlen(PIDstr) + 1, sizeof(char));
 
   // loop through the input one character at a time these indices
-  // keep track of our current place in the string and the starting
-  // position to copy from
-  int index = 0;
+  // keep track of our current place in the input and the output
+  int outIndex = 0;
+  index = 0;
 
-  while (index <= strlen(inputString)) {
+  while (inputString[index] != '\0') {
 
     // if the next two characters are $$ then insert the PID and move forward
-    // the index pointer 2 and the start pointer to match
+    // the index pointer 2 and the output pointer to match
     if (inputString[index] == delim && inputString[index + 1] == delim) {
-      strcat(tempStr, PIDstr);
+      strcpy(replacement_buffer + outIndex, PIDstr);
+      outIndex = outIndex + strlen(PIDstr);
       index = index + 2;
     }
 
     // otherwise just copy the character at the pointer advance
     else {
-      strncat(tempStr, inputString + index, 1);
+      replacement_buffer[outIndex++] = inputString[index];
       index++;
     }
   }
 
-  // place the expanded string into heap allocated memory so it
-  // can be returned without vanishing
-  char *replacement_buffer;
-  replacement_buffer = malloc(strlen(tempStr) * sizeof(char));
-  memset(replacement_buffer, '\0', sizeof(*replacement_buffer));
-  strcpy(replacement_buffer, tempStr);
-
   // return the expanded string for outside use
   return replacement_buffer;
 }
@@ -100,11 +277,15 @@ char *expandInput(char inputString[]) {
  *			int size 		the size of the array of string
  *							pointers for use by future functions to iterate
  *							through the array.
+ *
+ *			char *expanded	flags the strings in arr that were allocated by
+ *							expandInput rather than pointing into the input
  * */
 
 struct sizedArgArr {
   char **arr;
   int size;
+  char *expanded;
 };
 
 /******************************************************************************
@@ -126,11 +307,12 @@ struct sizedArgArr *parse(char inputString[]) {
   char *savePTR;
 
   // allocated on the heap for future return
-  struct sizedArgArr *argStruct = malloc(sizeof(struct sizedArgArr));
+  struct sizedArgArr *argStruct = parseAlloc(1, sizeof(struct sizedArgArr));
 
   // create a blank pointer array of the size of tokesn
   // to hold them
-  argStruct->arr = calloc(size + 1, sizeof(char *));
+  argStruct->arr = parseAlloc(size + 1, sizeof(char *));
+  argStruct->expanded = parseAlloc(size + 1, sizeof(char));
 
   token = strtok_r(inputString, " \n", &savePTR);
 
@@ -140,6 +322,7 @@ struct sizedArgArr *parse(char inputString[]) {
     // check if a string needs to be expanded
     if (strstr(token, "$$") != NULL) {
       token = expandInput(token);
+      argStruct->expanded[index] = 1;
     }
     // place the tokens into an args array
     argStruct->arr[index++] = token;
@@ -152,6 +335,35 @@ struct sizedArgArr *parse(char inputString[]) {
   return argStruct;
 }
 
+/* a deadline on a running command, driven by a timerfd
+ * Includes:
+ *			int timerFD		the timer counting down to the next escalation
+ *							or -1 when there is no deadline (left)
+ *			int stage		0 before the deadline, 1 once SIGTERM has been
+ *							sent and 2 once SIGKILL has been sent
+ *			double timeout	the seconds the command was allowed to run
+ *			double killAfter	the grace period between SIGTERM and SIGKILL
+ * */
+struct deadline {
+  int timerFD;
+  int stage;
+  double timeout;
+  double killAfter;
+};
+
+// struct to track background processes
+// has an INT to represent the BGPID, its
+// deadline and a pointer to the next one
+struct bgProc {
+  int PID;
+  struct deadline deadline;
+  struct bgProc *next;
+};
+
+// the shell's background processes, kept global so their deadlines can
+// be enforced while waiting on a foreground command
+struct bgProc *bgProcs = NULL;
+
 /*The struct to hold command information*/
 struct procObj {
   char *command;
@@ -160,6 +372,13 @@ struct procObj {
   char *output;
   int background;
   int parentProc;
+  int hasTimeout;
+  double timeout;
+  double killAfter;
+  struct deadline deadline;
+  int captureFD;
+  struct sizedArgArr *parsed;
+  char *error;
 };
 
 /******************************************************************************
@@ -172,17 +391,22 @@ struct procObj {
  * Where:			char *input - a pointer to the input string
  *
  * Return:			struct procObj *command - a pointer to a command object representing
- *					the command to be executed by the shell
+ *					the command to be executed by the shell, with error
+ *					set if the line could not be parsed
  *****************************************************************************/
 struct procObj *createInputObject(char *input) {
-  struct procObj *command = malloc(sizeof(struct procObj));
+  // calloc so redirections left unspecified are NULL rather than garbage
+  struct procObj *command = parseAlloc(1, sizeof(struct procObj));
+  command->captureFD = -1;
 
-  // parse out and expand the input
+  // parse out and expand the input, keeping hold of the tokens so that
+  // freeInputObject can release them
   struct sizedArgArr *argStruct = parse(input);
   char **parsedInput = argStruct->arr;
+  command->parsed = argStruct;
 
   // create an array to hold all the arguments
-  command->args = calloc(argStruct->size + 1, sizeof(char *));
+  command->args = parseAlloc(argStruct->size + 1, sizeof(char *));
 
   // check that the user didn't enter a comment or a null line
   // in that case just return a null command object which
@@ -195,7 +419,7 @@ struct procObj *createInputObject(char *input) {
   }
 
   // initate the command portion of the struct on the heap so that it can be returned
-  command->command = calloc(strlen(parsedInput[0]) + 1, sizeof(char));
+  command->command = parseAlloc(strlen(parsedInput[0]) + 1, sizeof(char));
   strcpy(command->command, parsedInput[0]);
 
   // loop through the input array and parse it out
@@ -209,7 +433,13 @@ struct procObj *createInputObject(char *input) {
     // initiate the input location (if specificed) otherwise leave it as null
     if (strcmp(currTok, "<") == 0) {
       char *inputStr = parsedInput[i + 1];
-      command->input = calloc(strlen(inputStr) + 1, sizeof(char));
+
+      // a trailing redirection has nothing to redirect to, refuse the line
+      if (inputStr == NULL) {
+        command->error = "missing file name after <";
+        return command;
+      }
+      command->input = parseAlloc(strlen(inputStr) + 1, sizeof(char));
       strcpy(command->input, inputStr);
 
       // advance one extra to skip the next element
@@ -220,7 +450,13 @@ struct procObj *createInputObject(char *input) {
     // initiate the output location (if specificed) otherwise leave it as null
     if (strcmp(currTok, ">") == 0) {
       char *outputStr = parsedInput[i + 1];
-      command->output = calloc(strlen(outputStr) + 1, sizeof(char));
+
+      // a trailing redirection has nothing to redirect to, refuse the line
+      if (outputStr == NULL) {
+        command->error = "missing file name after >";
+        return command;
+      }
+      command->output = parseAlloc(strlen(outputStr) + 1, sizeof(char));
       strcpy(command->output, outputStr);
 
       // advance one extra to skip the next element
@@ -256,6 +492,36 @@ struct procObj *createInputObject(char *input) {
   return command;
 }
 
+/******************************************************************************
+ * Function:        freeInputObject
+ *
+ * Description:		frees a command object made by createInputObject along
+ *					with everything parsed for it. The args point into the
+ *					parsed tokens so they go at the same time.
+ *
+ * Where:			struct procObj *command - the command object to free
+ *
+ * Return:			void
+ *****************************************************************************/
+void freeInputObject(struct procObj *command) {
+  struct sizedArgArr *argStruct = command->parsed;
+
+  for (int i = 0; i < argStruct->size; i++) {
+    if (argStruct->expanded[i]) {
+      free(argStruct->arr[i]);
+    }
+  }
+  free(argStruct->expanded);
+  free(argStruct->arr);
+  free(argStruct);
+
+  free(command->command);
+  free(command->input);
+  free(command->output);
+  free(command->args);
+  free(command);
+}
+
 /******************************************************************************
  * Function:		int cd(struct procObj *command)
  *
@@ -300,363 +566,2536 @@ int cd(struct procObj *command) {
 }
 
 /******************************************************************************
- * Function:        executeInput
- * Description:		execute the command represented by a procObj
- * Where:			- procObj* command - the struct containing the information
- *					necessary to complete a command
- *					- int *exitStatus - a pointer to the int representing the exit
- *					status of the shell's last command.
+ * Function:        execChild
+ * Description:		the child half of a launch: installs the child's signal
+ *					dispositions, performs any I/O redirection and then
+ *					execs the command. Shared by the shell's own fork path
+ *					and by the launcher process.
+ * Where:			- procObj* command - the command to execute
  *					- sigaction INTact - the sigaction struct associated with SIGNINT
  *					- sigaction STPact - the sigaction struct associated with SIGTSP
  *
- * Return:			the PID of the command executed
+ * Return:			never returns
  *****************************************************************************/
-int executeInput(struct procObj *command, int *exitStatus,
-                 struct sigaction INTact, struct sigaction STPact) {
+void execChild(struct procObj *command, struct sigaction INTact,
+               struct sigaction STPact) {
+
+  // timed and background commands get a process group of their own so a
+  // deadline reaches everything they start. A timed foreground command
+  // also takes the terminal so ^C still reaches it
+  if (command->background == 1 || command->hasTimeout) {
+    setpgid(0, 0);
+    if (command->background == 0 && isatty(STDIN_FILENO)) {
+      tcsetpgrp(STDIN_FILENO, getpid());
+    }
+  }
+  signal(SIGTTOU, SIG_DFL);
 
-  // skip null commands
-  if (command->command == NULL) {
-    return 0;
+  // install a signal handler to allow for SIGINT in FG procs
+  if (command->background == 0) {
+    INTact.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &INTact, NULL);
   }
 
-  // special path for CD
-  if (strcmp(command->command, "cd") == 0) {
-    int cmdStatus = cd(command);
-    return cmdStatus;
+  // install a signal handler for SIGTSTP to just ignore it
+  STPact.sa_handler = SIG_IGN;
+  sigaction(SIGTSTP, &STPact, NULL);
+
+  // /*: redirect I/O if non-STDIN/STDOUT specified */
+  // if the given input string is not null redirect input
+  if (command->input != NULL) {
+    int sourceFD = open(command->input, O_RDONLY);
+    if (sourceFD == -1) {
+      perror("source open()");
+      exit(1);
+    }
+
+    // attempt the redirection and exit if it fails
+    int result = dup2(sourceFD, 0);
+    if (result == -1) {
+      perror("source dup2()");
+      exit(1);
+    }
+
+    fcntl(sourceFD, F_SETFD, FD_CLOEXEC);
   }
 
-  // otherwise fork then call execvp
-  else {
+  // if the given output string is not null redirect output
+  if (command->output != NULL) {
+    int targetFD = open(command->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (targetFD == -1) {
+      perror("target open()");
+      exit(1);
+    }
+
+    // Redirect stdout to target file
+    int result = dup2(targetFD, 1);
+    if (result == -1) {
+      perror("target dup2()");
+      exit(1);
+    }
+    fcntl(targetFD, F_SETFD, FD_CLOEXEC);
+  }
 
-    // int to hold the return status generated by WAITPID
-    int childStatus;
+  // send stdout and stderr down a capture pipe if one was given
+  if (command->captureFD != -1) {
+    if (dup2(command->captureFD, 1) == -1 || dup2(command->captureFD, 2) == -1) {
+      perror("capture dup2()");
+      exit(1);
+    }
+  }
 
-    // fork a new process and check that it succeeded
-    // attempt to fork the process
-    pid_t childPID = fork();
+  // if I/O file descriptors not set AND BG flag set redirect to /dev/null
+  // redirects input to /dev/null if no other input set
+  if (command->input == NULL && command->background == 1) {
 
-    if (childPID < 0) {
-      // Code in this branch will be exected by the parent when fork() fails and
-      // the creation of child process fails as well
-      perror("fork() failed!");
+    int sourceFD = open("/dev/null", O_RDONLY);
+    if (sourceFD == -1) {
+      perror("source open()");
       exit(1);
     }
 
-    // childPID is 0. This means we are in the child process and the child will
-    // execute the code in this branch
-    if (childPID == 0) {
+    // attempt the redirection and exit if it fails
+    int result = dup2(sourceFD, 0);
+    if (result == -1) {
+      perror("source dup2()");
+      exit(1);
+    }
+    printf("redirected input to /dev/null");
+    fcntl(sourceFD, F_SETFD, FD_CLOEXEC);
+  }
 
-      // install a signal handler to allow for SIGINT in FG procs
-      if (command->background == 0) {
-        INTact.sa_handler = SIG_DFL;
-        sigaction(SIGINT, &INTact, NULL);
-      }
+  // redirects output to /dev/null if no other output set
+  if (command->output == NULL && command->captureFD == -1 &&
+      command->background == 1) {
 
-      // install a signal handler for SIGTSTP to just ignore it
-      STPact.sa_handler = SIG_IGN;
-      sigaction(SIGTSTP, &STPact, NULL);
+    int targetFD = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (targetFD == -1) {
+      perror("target open()");
+      exit(1);
+    }
 
-      // /*: redirect I/O if non-STDIN/STDOUT specified */
-      // if the given input string is not null redirect input
-      if (command->input != NULL) {
-        int sourceFD = open(command->input, O_RDONLY);
-        if (sourceFD == -1) {
-          perror("source open()");
-          return 1;
-        }
+    // Redirect stdout to target file
+    int result = dup2(targetFD, 1);
+    if (result == -1) {
+      perror("target dup2()");
+      exit(2);
+    }
+    printf("redirected output to /dev/null");
+    fflush(stdout);
+    fcntl(targetFD, F_SETFD, FD_CLOEXEC);
+  }
 
-        // attempt the redirection and exit if it fails
-        int result = dup2(sourceFD, 0);
-        if (result == -1) {
-          perror("source dup2()");
-          return 1;
-        }
+  // execute the passed comand in its own thread.
+  execvp(command->command, command->args);
 
-        fcntl(sourceFD, F_SETFD, FD_CLOEXEC);
-      }
+  // print error message if execution fails
+  perror("source - exec");
+  printf("Execution of %s failed \n", command->command);
+  fflush(stdout);
 
-      // if the given output string is not null redirect output
-      if (command->output != NULL) {
-        int targetFD =
-            open(command->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (targetFD == -1) {
-          perror("target open()");
-          return 1;
-        }
+  // this line is to make sure failed processes are killed and reaped
+  // they previously were remaining despited waitPIDing them and lived
+  // as zombies in the backround.
+  kill(getpid(), SIGKILL);
+  exit(1);
+}
 
-        // Redirect stdout to target file
-        int result = dup2(targetFD, 1);
-        if (result == -1) {
-          perror("target dup2()");
-          return 1;
-        }
-        fcntl(targetFD, F_SETFD, FD_CLOEXEC);
-      }
+/* The launcher ("zygote") is a small helper forked from the shell at startup
+ * while its image is still tiny. Once running the shell hands it launch
+ * requests over a SOCK_SEQPACKET socketpair instead of forking itself, so the
+ * cost of each fork no longer grows with the shell's history, caches and job
+ * lists. Each request carries the cwd, redirections, argv and environment of
+ * the command with the shell's stdin/stdout/stderr attached via SCM_RIGHTS.
+ * The launcher is the real parent of every command it starts; it replies
+ * with the child's PID and later forwards the raw waitpid() status. */
 
-      // if I/O file descriptors not set AND BG flag set redirect to /dev/null
-      // redirects input to /dev/null if no other input set
-      if (command->input == NULL && command->background == 1) {
+// the shell's end of the launcher socket, -1 when no launcher is running
+int zygoteFD = -1;
 
-        int sourceFD = open("/dev/null", O_RDONLY);
-        if (sourceFD == -1) {
-          perror("source open()");
-          return 1;
-        }
+// largest launch request we will send; larger commands are forked directly
+#define ZYGOTE_MSG_MAX 65536
 
-        // attempt the redirection and exit if it fails
-        int result = dup2(sourceFD, 0);
-        if (result == -1) {
-          perror("source dup2()");
-          return 1;
-        }
-        printf("redirected input to /dev/null");
-        fcntl(sourceFD, F_SETFD, FD_CLOEXEC);
-      }
+// reply types sent from the launcher back to the shell
+#define ZYGOTE_SPAWNED 1
+#define ZYGOTE_FAILED 2
+#define ZYGOTE_EXITED 3
 
-      // redirects output to /dev/null if no other output set
-      if (command->output == NULL && command->background == 1) {
+/* the fixed size header at the front of every launch request
+ * Includes:
+ *			int background	whether the command was backgrounded
+ *			int timed		whether the command has a timeout
+ *			int capture		whether the stdout/stderr sent are a capture
+ *							pipe rather than the shell's own
+ *			int argc		the number of argv strings that follow
+ *			int envc		the number of environment strings that follow
+ * */
+struct zygoteRequest {
+  int background;
+  int timed;
+  int capture;
+  int argc;
+  int envc;
+};
 
-        int targetFD = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (targetFD == -1) {
-          perror("target open()");
-          exit(1);
-        }
+/* a reply from the launcher
+ * Includes:
+ *			int type		one of the ZYGOTE_* reply types
+ *			pid_t PID		the PID the reply is about
+ *			int status		the raw waitpid() status for ZYGOTE_EXITED or
+ *							the errno for ZYGOTE_FAILED
+ * */
+struct zygoteMsg {
+  int type;
+  pid_t PID;
+  int status;
+};
 
-        // Redirect stdout to target file
-        int result = dup2(targetFD, 1);
-        if (result == -1) {
-          perror("target dup2()");
-          exit(2);
-        }
-        printf("redirected output to /dev/null");
-        fflush(stdout);
-        fcntl(targetFD, F_SETFD, FD_CLOEXEC);
-      }
+/* a command started by the launcher that has not been collected yet.
+ * Only these PIDs are waited for through the launcher, anything the shell
+ * forked itself is still waitpid()ed.
+ * Includes:
+ *			pid_t PID		the command's PID
+ *			int exited		set once the launcher has reported its exit
+ *			int status		the raw waitpid() status once exited
+ * */
+struct zygoteChild {
+  pid_t PID;
+  int exited;
+  int status;
+  struct zygoteChild *next;
+};
 
-      // execute the passed comand in its own thread.
-      int execReturn;
-      execReturn = execvp(command->command, command->args);
+struct zygoteChild *zygoteChildren = NULL;
 
-      // print error message (and return 1) if execution fails
-      if (execReturn == -1) {
-        perror("source - exec");
-        printf("Execution of %s failed \n", command->command);
+/******************************************************************************
+ * Function:        zygoteLoop
+ * Description:		the main loop of the launcher process. Waits for launch
+ *					requests and child exits and services each in turn. Exits
+ *					once the shell closes its end of the socket.
+ * Where:			- int sockFD - the launcher's end of the socketpair
+ *					- sigaction INTact - the shell's SIGINT sigaction
+ *					- sigaction STPact - the shell's SIGTSTP sigaction
+ *
+ * Return:			never returns
+ *****************************************************************************/
+void zygoteLoop(int sockFD, struct sigaction INTact, struct sigaction STPact) {
+  static char buffer[ZYGOTE_MSG_MAX];
+  char cmsgBuffer[CMSG_SPACE(3 * sizeof(int))];
+
+  // the launcher shares the terminal's process group so keyboard SIGTSTPs
+  // reach it too, it should not act on them
+  signal(SIGTSTP, SIG_IGN);
+
+  // take SIGCHLD through a signalfd so it can be polled next to the socket
+  sigset_t childMask;
+  sigemptyset(&childMask);
+  sigaddset(&childMask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &childMask, NULL);
+  int sigFD = signalfd(-1, &childMask, SFD_CLOEXEC);
+  if (sigFD == -1) {
+    perror("launcher signalfd()");
+    _exit(1);
+  }
 
-        // this line is to make sure failed processes are killed and reaped
-        // they previously were remaining despited waitPIDing them and lived
-        // as zombies in the backround.
-        kill(getpid(), SIGKILL);
+  struct pollfd fds[2] = {{sockFD, POLLIN, 0}, {sigFD, POLLIN, 0}};
 
-        // return that the execution failed
-        return childPID;
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
       }
+      _exit(1);
+    }
+
+    // forward the status of every child that has terminated
+    if (fds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      read(sigFD, &info, sizeof(info));
 
+      int status;
+      pid_t PID;
+      while ((PID = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct zygoteMsg msg = {ZYGOTE_EXITED, PID, status};
+        send(sockFD, &msg, sizeof(msg), MSG_NOSIGNAL);
+      }
     }
 
-    // spawnpid is the pid of the child. This means the parent will execute
-    // the code in this branch
+    if (!(fds[0].revents & (POLLIN | POLLHUP))) {
+      continue;
+    }
 
-    else {
-      // check the background flag - if set return the PID to track for later
-      // termination
-      if (command->background == 1) {
+    // receive the request along with the shell's stdin/stdout/stderr
+    struct iovec iov = {buffer, sizeof(buffer)};
+    struct msghdr msgHdr = {0};
+    msgHdr.msg_iov = &iov;
+    msgHdr.msg_iovlen = 1;
+    msgHdr.msg_control = cmsgBuffer;
+    msgHdr.msg_controllen = sizeof(cmsgBuffer);
 
-        // if backgrounding return the PID
-        int termination = waitpid(childPID, &childStatus, WNOHANG);
-        printf("backgrounded PID is: %d\n", childPID);
-        fflush(stdout);
-        return childPID;
+    ssize_t len = recvmsg(sockFD, &msgHdr, MSG_CMSG_CLOEXEC);
+
+    // the shell has gone away so there is nothing left to do
+    if (len <= 0) {
+      _exit(0);
+    }
 
+    int stdFDs[3] = {-1, -1, -1};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgHdr);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(stdFDs))) {
+      memcpy(stdFDs, CMSG_DATA(cmsg), sizeof(stdFDs));
+    }
+
+    // unpack the header then the NUL separated strings that follow it
+    struct zygoteRequest request;
+    int valid = len > sizeof(request) && stdFDs[0] != -1;
+    static char *strings[ZYGOTE_MSG_MAX + 2];
+    int stringCount = 0;
+
+    if (valid) {
+      memcpy(&request, buffer, sizeof(request));
+      char *pos = buffer + sizeof(request);
+      char *end = buffer + len;
+      while (pos < end) {
+        strings[stringCount++] = pos;
+        pos += strnlen(pos, end - pos) + 1;
       }
+      valid = request.argc > 0 && request.envc >= 0 &&
+              stringCount == 3 + request.argc + request.envc;
+    }
 
-      // otherwise wait for the process to terminate then return
-      else {
+    if (!valid) {
+      struct zygoteMsg msg = {ZYGOTE_FAILED, -1, EINVAL};
+      send(sockFD, &msg, sizeof(msg), MSG_NOSIGNAL);
+    }
 
-        // point to exitStatus since this is a FG process for status
-        waitpid(childPID, exitStatus, 0);
+    else {
+      pid_t childPID = fork();
 
-        // check how it exited and set the exit status variable
-        if (WIFEXITED(*exitStatus)) {
-          *exitStatus = WEXITSTATUS(*exitStatus);
-        } else {
-          *exitStatus = WTERMSIG(*exitStatus);
-          // if killed by a signal we want to alert the user of which
-          printf("Process killed by signal: %d \n", *exitStatus);
+      if (childPID == 0) {
+        // take over the shell's standard streams
+        for (int i = 0; i < 3; i++) {
+          dup2(stdFDs[i], i);
+        }
+
+        if (chdir(strings[0]) != 0) {
+          perror("launcher chdir()");
+          _exit(1);
         }
+
+        // terminate the argv and env arrays in place within strings[]
+        // by shifting env up one slot to make room for argv's NULL
+        char **args = strings + 3;
+        char **envp = args + request.argc + 1;
+        memmove(envp, args + request.argc, request.envc * sizeof(char *));
+        args[request.argc] = NULL;
+        envp[request.envc] = NULL;
+        environ = envp;
+
+        sigprocmask(SIG_UNBLOCK, &childMask, NULL);
+
+        struct procObj command = {0};
+        command.command = args[0];
+        command.args = args;
+        command.input = strings[1][0] != '\0' ? strings[1] : NULL;
+        command.output = strings[2][0] != '\0' ? strings[2] : NULL;
+        command.background = request.background;
+        command.hasTimeout = request.timed;
+        command.captureFD = request.capture ? STDOUT_FILENO : -1;
+        execChild(&command, INTact, STPact);
+      }
+
+      struct zygoteMsg msg = {ZYGOTE_SPAWNED, childPID, 0};
+      if (childPID < 0) {
+        msg.type = ZYGOTE_FAILED;
+        msg.status = errno;
       }
+      send(sockFD, &msg, sizeof(msg), MSG_NOSIGNAL);
     }
 
-    // this is to keep the compiler from complaining
-    return 0;
+    for (int i = 0; i < 3; i++) {
+      if (stdFDs[i] != -1) {
+        close(stdFDs[i]);
+      }
+    }
   }
 }
 
-// struct to track background processes
-// has an INT to represent the BGPID and 
-// a pointer to the next one
-struct bgProc {
-  int PID;
-  struct bgProc *next;
-};
-
-// LL initializer
 /******************************************************************************
- * Function:			createLL
- * Description:			initate a LL to track bgProcs	
- * Where:				void
+ * Function:        startZygote
+ * Description:		forks the launcher process and records the shell's end
+ *					of the socket in zygoteFD. Should be called once the
+ *					shell's signal handlers are installed so the launcher
+ *					inherits them.
+ * Where:			- sigaction INTact - the shell's SIGINT sigaction
+ *					- sigaction STPact - the shell's SIGTSTP sigaction
  *
- * Return:				head - a bgProc struct representing the head of the LL
+ * Return:			0 on success or -1 if the launcher could not be started
  *****************************************************************************/
-struct bgProc *createLL(void) {
-  struct bgProc *head = malloc(sizeof(struct bgProc));
+int startZygote(struct sigaction INTact, struct sigaction STPact) {
+  int sockFDs[2];
 
-  head->PID = -1;
-  head->next = NULL;
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockFDs) == -1) {
+    perror("launcher socketpair()");
+    return -1;
+  }
 
-  return head;
+  pid_t zygotePID = fork();
+
+  if (zygotePID < 0) {
+    perror("launcher fork()");
+    close(sockFDs[0]);
+    close(sockFDs[1]);
+    return -1;
+  }
+
+  if (zygotePID == 0) {
+    close(sockFDs[0]);
+    zygoteLoop(sockFDs[1], INTact, STPact);
+  }
+
+  close(sockFDs[1]);
+  zygoteFD = sockFDs[0];
+  return 0;
 }
 
-// add to LL
 /******************************************************************************
- * Function:		addBgProc
- * Description:		adds a background process to the tracking LL
- * Where:			*head - a pointer to the head of the LL
- *					newPID - the PID of the process to add
- * Return:			int representing successful addition
+ * Function:        stopZygote
+ * Description:		drops the connection to a launcher that has stopped
+ *					responding so that later launches fork directly.
+ * Where:			void
+ * Return:			void
  *****************************************************************************/
-int addBgProc(struct bgProc *head, int newPID) {
-  // instantiate a new node with the given pid
-  struct bgProc *newProc = malloc(sizeof(struct bgProc));
-  newProc->PID = newPID;
-  newProc->next = NULL;
+void stopZygote(void) {
+  if (zygoteFD != -1) {
+    close(zygoteFD);
+    zygoteFD = -1;
+  }
+}
 
+/******************************************************************************
+ * Function:        zygoteFind
+ * Description:		looks up a command started by the launcher
+ * Where:			- pid_t PID - the PID to look for
+ * Return:			its zygoteChild or NULL if the launcher didn't start it
+ *****************************************************************************/
+struct zygoteChild *zygoteFind(pid_t PID) {
+  struct zygoteChild *child = zygoteChildren;
 
-  // iterate to the end of the list
-  while (head->next != NULL) {
-    head = head->next;
+  while (child != NULL && child->PID != PID) {
+    child = child->next;
   }
 
-  // attach the new node to the end of the list
-  head->next = newProc;
-
-  // return 1 to indicate success
-  return 1;
+  return child;
 }
 
-// function to print LL PIDS
 /******************************************************************************
- * Function:		showPIDS 
- * Description:		a fancy print function for the backgrounded PIDs
- * Where:			bgProc *head - the head of the bg tracking LL
- * Return:			void
+ * Function:        zygoteRecv
+ * Description:		reads one reply from the launcher, stashing exit
+ *					statuses for later collection by launcherWait.
+ * Where:			- struct zygoteMsg *msg - where to write the reply
+ *					- int flags - flags for recv(), e.g. MSG_DONTWAIT
+ *
+ * Return:			1 if a reply was read, 0 if none was waiting and -1 if
+ *					the launcher has gone away
  *****************************************************************************/
-void showPIDs(struct bgProc *head) {
-  while (head != NULL) {
-    printf("bPID: %d \n", head->PID);
-    head = head->next;
+int zygoteRecv(struct zygoteMsg *msg, int flags) {
+  ssize_t len;
+
+  do {
+    len = recv(zygoteFD, msg, sizeof(*msg), flags);
+  } while (len == -1 && errno == EINTR);
+
+  if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+
+  if (len != sizeof(*msg)) {
+    stopZygote();
+    return -1;
+  }
+
+  if (msg->type == ZYGOTE_EXITED) {
+    struct zygoteChild *child = zygoteFind(msg->PID);
+    if (child != NULL) {
+      child->exited = 1;
+      child->status = msg->status;
+    }
   }
+
+  return 1;
 }
 
-// function to remove dead processes from LL
 /******************************************************************************
- * Function:		removeNext
- * Description:		given a node removed the the node following it from the 
- *					proc tracking LL by pointing the current pointer past it
- * Where:			bgProc * node - the node we want to remove the successor to
+ * Function:        zygoteDrain
+ * Description:		reads every reply the launcher has waiting without
+ *					blocking, so its socket stops polling as readable once
+ *					the exits it reported have been recorded
+ * Where:			void
  * Return:			void
  *****************************************************************************/
-void removeNext(struct bgProc *node) { node->next = node->next->next; }
+void zygoteDrain(void) {
+  struct zygoteMsg msg;
+  int received = 1;
+
+  while (zygoteFD != -1 && received == 1) {
+    received = zygoteRecv(&msg, MSG_DONTWAIT);
+  }
+}
+
+/******************************************************************************
+ * Function:        zygoteLaunch
+ * Description:		asks the launcher to start a command
+ * Where:			- procObj* command - the command to start
+ *
+ * Return:			the PID of the started command, 0 if the launcher could
+ *					not fork or -1 if the request could not be delivered and
+ *					the caller should fork the command itself
+ *****************************************************************************/
+pid_t zygoteLaunch(struct procObj *command) {
+  static char buffer[ZYGOTE_MSG_MAX];
+  char cwd[4096];
+
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    return -1;
+  }
+
+  struct zygoteRequest request = {command->background, command->hasTimeout,
+                                  command->captureFD != -1, 0, 0};
+  size_t len = sizeof(request);
+
+  // pack cwd, input, output, argv and the environment as NUL separated
+  // strings behind the header, giving up if they will not fit
+  char *empty = "";
+  char *fixed[4] = {cwd, command->input ? command->input : empty,
+                    command->output ? command->output : empty, NULL};
+  char **lists[3] = {fixed, command->args, environ};
+
+  for (int list = 0; list < 3; list++) {
+    for (int i = 0; lists[list][i] != NULL; i++) {
+      size_t strLen = strlen(lists[list][i]) + 1;
+      if (len + strLen > sizeof(buffer)) {
+        return -1;
+      }
+      memcpy(buffer + len, lists[list][i], strLen);
+      len += strLen;
+
+      if (list == 1) {
+        request.argc++;
+      } else if (list == 2) {
+        request.envc++;
+      }
+    }
+  }
+  memcpy(buffer, &request, sizeof(request));
+
+  // attach our stdin/stdout/stderr so the command writes where we would,
+  // or the capture pipe in place of stdout/stderr
+  int stdFDs[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  if (command->captureFD != -1) {
+    stdFDs[1] = command->captureFD;
+    stdFDs[2] = command->captureFD;
+  }
+  char cmsgBuffer[CMSG_SPACE(sizeof(stdFDs))];
+  memset(cmsgBuffer, 0, sizeof(cmsgBuffer));
+
+  struct iovec iov = {buffer, len};
+  struct msghdr msgHdr = {0};
+  msgHdr.msg_iov = &iov;
+  msgHdr.msg_iovlen = 1;
+  msgHdr.msg_control = cmsgBuffer;
+  msgHdr.msg_controllen = sizeof(cmsgBuffer);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgHdr);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(stdFDs));
+  memcpy(CMSG_DATA(cmsg), stdFDs, sizeof(stdFDs));
+
+  if (sendmsg(zygoteFD, &msgHdr, MSG_NOSIGNAL) == -1) {
+    stopZygote();
+    return -1;
+  }
+
+  // wait for the launch result, stashing any exits that arrive first
+  struct zygoteMsg msg;
+  while (zygoteRecv(&msg, 0) == 1) {
+    if (msg.type == ZYGOTE_SPAWNED) {
+      struct zygoteChild *child = calloc(1, sizeof(struct zygoteChild));
+      child->PID = msg.PID;
+      child->next = zygoteChildren;
+      zygoteChildren = child;
+      return msg.PID;
+    }
+    if (msg.type == ZYGOTE_FAILED) {
+      errno = msg.status;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/******************************************************************************
+ * Function:        launcherWait
+ * Description:		waitpid() for commands that may have been started by the
+ *					launcher. Commands the launcher didn't start are
+ *					waitpid()ed as usual.
+ * Where:			- pid_t PID - the PID to wait for
+ *					- int *status - where to write the raw exit status
+ *					- int options - waitpid() options, only WNOHANG is used
+ *
+ * Return:			the PID once it has terminated, 0 if WNOHANG was given
+ *					and it is still running or -1 on error
+ *****************************************************************************/
+pid_t launcherWait(pid_t PID, int *status, int options) {
+  struct zygoteChild **link = &zygoteChildren;
+  while (*link != NULL && (*link)->PID != PID) {
+    link = &(*link)->next;
+  }
+
+  if (*link == NULL) {
+    return waitpid(PID, status, options);
+  }
+
+  while (1) {
+    // collect the exit once the launcher has reported it, or give up on it
+    // if the launcher has gone away since it is the only one who can
+    struct zygoteChild *child = *link;
+    if (child->exited || zygoteFD == -1) {
+      int exited = child->exited;
+      *status = child->status;
+      *link = child->next;
+      free(child);
+
+      if (!exited) {
+        errno = ECHILD;
+        return -1;
+      }
+      return PID;
+    }
+
+    struct zygoteMsg msg;
+    int received = zygoteRecv(&msg, (options & WNOHANG) ? MSG_DONTWAIT : 0);
+    if (received == 0) {
+      return 0;
+    }
+    if (received == -1) {
+      errno = ECHILD;
+      return -1;
+    }
+  }
+}
+
+/* Deadlines for commands started with the timeout builtin, and for
+ * background commands once a default has been set with `timeout -b`. Each
+ * deadline is a timerfd so it can be polled next to whatever the shell is
+ * already waiting on: the foreground child, the launcher socket, or the
+ * terminal at the prompt. No helper process is needed per command. */
+
+// default deadline in seconds for background commands, 0 for none
+double bgTimeout = 0;
+
+// seconds between SIGTERM and SIGKILL unless timeout -k says otherwise
+#define DEFAULT_KILL_AFTER 5.0
+
+// the exit status recorded for a command stopped by its deadline
+#define TIMEOUT_STATUS 124
+
+/******************************************************************************
+ * Function:        parseDuration
+ * Description:		parses a duration such as 30, 30s, 1.5m, 2h or 1d
+ * Where:			- char *str - the duration string
+ *					- double *seconds - where to write the duration in seconds
+ *
+ * Return:			0 on success or -1 if the string is not a duration
+ *****************************************************************************/
+int parseDuration(char *str, double *seconds) {
+  char *end;
+  double value = strtod(str, &end);
+
+  // also rejects nan and absurdly large values timerfd can't hold
+  if (end == str || !(value >= 0 && value < 1e9)) {
+    return -1;
+  }
+
+  if (*end == 'm') {
+    value *= 60;
+  } else if (*end == 'h') {
+    value *= 60 * 60;
+  } else if (*end == 'd') {
+    value *= 60 * 60 * 24;
+  } else if (*end != 's' && *end != '\0') {
+    return -1;
+  }
+
+  // nothing may follow the unit
+  if (*end != '\0' && end[1] != '\0') {
+    return -1;
+  }
+
+  *seconds = value;
+  return 0;
+}
+
+/******************************************************************************
+ * Function:        applyTimeout
+ * Description:		handles the timeout builtin. Either records the default
+ *					deadline for background commands (timeout -b DURATION)
+ *					or strips `timeout [-k DURATION] DURATION` off the front
+ *					of the command and records the deadline on it.
+ * Where:			- procObj* command - a command whose name is timeout
+ *					- int *exitStatus - the shell's exit status, set to 1 on
+ *					a usage error
+ *
+ * Return:			1 if a command remains to be executed otherwise 0
+ *****************************************************************************/
+int applyTimeout(struct procObj *command, int *exitStatus) {
+  char **args = command->args;
+  double killAfter = DEFAULT_KILL_AFTER;
+  double seconds;
+  int i = 1;
+
+  // timeout -b [DURATION] shows or sets the default for background commands
+  if (args[i] != NULL && strcmp(args[i], "-b") == 0) {
+    if (args[i + 1] == NULL) {
+      printf("background timeout: %gs \n", bgTimeout);
+      fflush(stdout);
+      return 0;
+    }
+    if (args[i + 2] == NULL && parseDuration(args[i + 1], &seconds) == 0) {
+      bgTimeout = seconds;
+      return 0;
+    }
+    args[i] = NULL;
+  }
+
+  if (args[i] != NULL && strcmp(args[i], "-k") == 0) {
+    if (args[i + 1] == NULL || parseDuration(args[i + 1], &killAfter) != 0) {
+      args[i] = NULL;
+    } else {
+      i = i + 2;
+    }
+  }
+
+  if (args[i] == NULL || parseDuration(args[i], &seconds) != 0 ||
+      args[i + 1] == NULL) {
+    if (!serveMode) {
+      printf("usage: timeout [-k DURATION] DURATION command [args] \n"
+             "       timeout -b [DURATION] \n");
+      fflush(stdout);
+    }
+    *exitStatus = 1;
+    return 0;
+  }
+
+  // shift the wrapped command and its args to the front
+  i++;
+  int argsIndex = 0;
+  while (args[i] != NULL) {
+    args[argsIndex++] = args[i++];
+  }
+  args[argsIndex] = NULL;
+
+  // the command name is a copy of its own so replace it with one
+  free(command->command);
+  command->command = parseAlloc(strlen(args[0]) + 1, sizeof(char));
+  strcpy(command->command, args[0]);
+  command->hasTimeout = 1;
+  command->timeout = seconds;
+  command->killAfter = killAfter;
+  return 1;
+}
+
+/******************************************************************************
+ * Function:        setTimer
+ * Description:		arms a timerfd to fire after the given seconds and then,
+ *					if an interval is given, repeatedly every interval
+ * Where:			- int timerFD - the timerfd to arm
+ *					- double seconds - the delay, must be positive
+ *					- double interval - the repeat interval, 0 to fire once
+ * Return:			void
+ *****************************************************************************/
+void setTimer(int timerFD, double seconds, double interval) {
+  struct itimerspec spec = {{0, 0}, {0, 0}};
+  spec.it_value.tv_sec = (time_t)seconds;
+  spec.it_value.tv_nsec = (long)((seconds - spec.it_value.tv_sec) * 1e9);
+  spec.it_interval.tv_sec = (time_t)interval;
+  spec.it_interval.tv_nsec =
+      (long)((interval - spec.it_interval.tv_sec) * 1e9);
+
+  // an all zero it_value would disarm the timer instead
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+    spec.it_value.tv_nsec = 1;
+  }
+
+  timerfd_settime(timerFD, 0, &spec, NULL);
+}
+
+/******************************************************************************
+ * Function:        armDeadline
+ * Description:		starts the clock on a command's deadline
+ * Where:			- struct deadline *dl - the deadline to initialise
+ *					- double timeout - seconds the command may run, 0 for
+ *					no deadline
+ *					- double killAfter - grace period after SIGTERM before
+ *					SIGKILL, 0 to never send SIGKILL
+ * Return:			void
+ *****************************************************************************/
+void armDeadline(struct deadline *dl, double timeout, double killAfter) {
+  dl->timerFD = -1;
+  dl->stage = 0;
+  dl->timeout = timeout;
+  dl->killAfter = killAfter;
+
+  if (timeout <= 0) {
+    return;
+  }
+
+  dl->timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (dl->timerFD == -1) {
+    perror("timerfd_create()");
+    return;
+  }
+
+  setTimer(dl->timerFD, timeout, 0);
+}
+
+/******************************************************************************
+ * Function:        signalGroup
+ * Description:		signals a command's process group so whatever it started
+ *					goes with it, or just the command if it has not made its
+ *					group yet
+ * Where:			- pid_t PID - the command's PID, which is also its group's
+ *					- int signo - the signal to send
+ * Return:			void
+ *****************************************************************************/
+void signalGroup(pid_t PID, int signo) {
+  if (kill(-PID, signo) == -1) {
+    kill(PID, signo);
+  }
+}
+
+/******************************************************************************
+ * Function:        checkDeadline
+ * Description:		if a deadline's timer has fired escalate against the
+ *					command: SIGTERM first then SIGKILL once the grace
+ *					period has also passed
+ * Where:			- struct deadline *dl - the command's deadline
+ *					- pid_t PID - the command's PID
+ *
+ * Return:			1 if the deadline fired otherwise 0
+ *****************************************************************************/
+int checkDeadline(struct deadline *dl, pid_t PID) {
+  uint64_t expirations;
+
+  if (dl->timerFD == -1 ||
+      read(dl->timerFD, &expirations, sizeof(expirations)) == -1) {
+    return 0;
+  }
+
+  if (dl->stage == 0) {
+    // a stopped process can't act on SIGTERM until it is continued
+    signalGroup(PID, SIGTERM);
+    signalGroup(PID, SIGCONT);
+    dl->stage = 1;
+    metrics.timeouts++;
+
+    if (dl->killAfter > 0) {
+      setTimer(dl->timerFD, dl->killAfter, 0);
+    }
+  }
+
+  else {
+    signalGroup(PID, SIGKILL);
+    dl->stage = 2;
+  }
+
+  return 1;
+}
+
+/******************************************************************************
+ * Function:        clearDeadline
+ * Description:		releases a deadline's timer once its command is reaped.
+ *					The stage is kept so the timeout can still be reported.
+ * Where:			- struct deadline *dl - the deadline to release
+ * Return:			void
+ *****************************************************************************/
+void clearDeadline(struct deadline *dl) {
+  if (dl->timerFD != -1) {
+    close(dl->timerFD);
+    dl->timerFD = -1;
+  }
+}
+
+/******************************************************************************
+ * Function:        checkBgDeadlines
+ * Description:		escalates against background processes whose deadline
+ *					has passed without reaping them, reaping is left to
+ *					clearDefunct at the prompt
+ * Where:			void
+ * Return:			void
+ *****************************************************************************/
+void checkBgDeadlines(void) {
+  // record exits the launcher has reported so a PID it has already reaped
+  // (and that may since have been reused) is never signalled
+  zygoteDrain();
+
+  for (struct bgProc *node = bgProcs; node != NULL; node = node->next) {
+    struct zygoteChild *child = zygoteFind(node->PID);
+    if (child == NULL || !child->exited) {
+      checkDeadline(&node->deadline, node->PID);
+    }
+  }
+}
+
+/******************************************************************************
+ * Function:        waitDeadline
+ * Description:		waits for a foreground command while enforcing its
+ *					deadline and those of the background processes, and
+ *					keeping the metrics dump going. Polls the command's
+ *					pidfd (or the launcher socket when the launcher started
+ *					it) next to the timers.
+ * Where:			- pid_t PID - the PID to wait for
+ *					- int *status - where to write the raw exit status
+ *					- struct deadline *dl - the command's deadline
+ *
+ * Return:			the PID once it has terminated or -1 on error
+ *****************************************************************************/
+pid_t waitDeadline(pid_t PID, int *status, struct deadline *dl) {
+  int bgTimers = 0;
+  for (struct bgProc *node = bgProcs; node != NULL; node = node->next) {
+    bgTimers += node->deadline.timerFD != -1;
+  }
+
+  // nothing to enforce or dump while waiting so simply block
+  if (dl->timerFD == -1 && bgTimers == 0 && metricsDumpFD == -1) {
+    return launcherWait(PID, status, 0);
+  }
+
+  // without a pidfd (pre 5.3 kernels) we fall back to checking every 100ms
+  int owned = zygoteFind(PID) != NULL;
+  int pidFD = -1;
+  if (!owned) {
+    pidFD = syscall(SYS_pidfd_open, PID, 0);
+  }
+
+  while (1) {
+    pid_t result = launcherWait(PID, status, WNOHANG);
+
+    if (result != 0) {
+      if (pidFD != -1) {
+        close(pidFD);
+      }
+      clearDeadline(dl);
+      return result;
+    }
+
+    // the command's exit, its own deadline, the metrics dump and the
+    // background deadlines
+    struct pollfd fds[3 + bgTimers];
+    int nfds = 0;
+    fds[nfds].fd = owned ? zygoteFD : pidFD;
+    fds[nfds++].events = POLLIN;
+    fds[nfds].fd = dl->timerFD;
+    fds[nfds++].events = POLLIN;
+    fds[nfds].fd = metricsDumpFD;
+    fds[nfds++].events = POLLIN;
+    for (struct bgProc *node = bgProcs; node != NULL; node = node->next) {
+      if (node->deadline.timerFD != -1) {
+        fds[nfds].fd = node->deadline.timerFD;
+        fds[nfds++].events = POLLIN;
+      }
+    }
+
+    int ready = poll(fds, nfds, fds[0].fd == -1 ? 100 : -1);
+    if (ready > 0 && fds[2].revents != 0) {
+      metricsDump();
+    }
+    checkDeadline(dl, PID);
+    checkBgDeadlines();
+  }
+}
+
+/******************************************************************************
+ * Function:        executeInput
+ * Description:		execute the command represented by a procObj
+ * Where:			- procObj* command - the struct containing the information
+ *					necessary to complete a command
+ *					- int *exitStatus - a pointer to the int representing the exit
+ *					status of the shell's last command.
+ *					- sigaction INTact - the sigaction struct associated with SIGNINT
+ *					- sigaction STPact - the sigaction struct associated with SIGTSP
+ *
+ * Return:			the PID of the command executed
+ *****************************************************************************/
+int executeInput(struct procObj *command, int *exitStatus,
+                 struct sigaction INTact, struct sigaction STPact) {
+
+  // no deadline unless one is armed once the command is launched
+  command->deadline.timerFD = -1;
+  command->deadline.stage = 0;
+
+  // skip null commands
+  if (command->command == NULL) {
+    return 0;
+  }
+
+  // timeout builtin, strip it off and run whatever it wraps
+  if (strcmp(command->command, "timeout") == 0 &&
+      applyTimeout(command, exitStatus) == 0) {
+    return 0;
+  }
+
+  // special path for CD
+  if (strcmp(command->command, "cd") == 0) {
+    int cmdStatus = cd(command);
+    return cmdStatus;
+  }
+
+  // otherwise hand the command to the launcher or fork then call execvp
+  else {
+
+    pid_t childPID = -1;
+    uint64_t spawnStart = nowNs();
+
+    // prefer the launcher when one is running, it falls back to us by
+    // returning -1 if the request could not be delivered
+    if (zygoteFD != -1) {
+      childPID = zygoteLaunch(command);
+      metrics.zygoteSpawns += childPID > 0;
+
+      if (childPID == 0) {
+        perror("launcher fork() failed!");
+        *exitStatus = 1;
+        return 0;
+      }
+    }
+
+    if (childPID == -1) {
+      // fork a new process and check that it succeeded
+      // attempt to fork the process
+      childPID = fork();
+
+      if (childPID < 0) {
+        // Code in this branch will be exected by the parent when fork() fails and
+        // the creation of child process fails as well. Report it like a
+        // command that failed, a server has other clients to keep serving
+        perror("fork() failed!");
+        *exitStatus = 1;
+        return 0;
+      }
+
+      // childPID is 0. This means we are in the child process and the child
+      // will execute the command
+      if (childPID == 0) {
+        execChild(command, INTact, STPact);
+      }
+      metrics.forkSpawns++;
+
+      // make the group from this side too so it exists before any deadline
+      if (command->background == 1 || command->hasTimeout) {
+        setpgid(childPID, childPID);
+      }
+    }
+    histRecord(&metrics.spawn, spawnStart);
+
+    // spawnpid is the pid of the child. This means the parent will execute
+    // the code in this branch
+
+    // start the clock on an explicit timeout or the background default
+    if (command->hasTimeout) {
+      armDeadline(&command->deadline, command->timeout, command->killAfter);
+    } else if (command->background == 1) {
+      armDeadline(&command->deadline, bgTimeout, DEFAULT_KILL_AFTER);
+    }
+
+    // check the background flag - if set return the PID to track for later
+    // termination
+    if (command->background == 1) {
+
+      // if backgrounding return the PID
+      if (!serveMode) {
+        printf("backgrounded PID is: %d\n", childPID);
+        fflush(stdout);
+      }
+      return childPID;
+
+    }
+
+    // otherwise wait for the process to terminate then return
+    else {
+
+      // point to exitStatus since this is a FG process for status
+      uint64_t waitStart = nowNs();
+      pid_t waited = waitDeadline(childPID, exitStatus, &command->deadline);
+      histRecord(&metrics.wait, waitStart);
+
+      // take the terminal back from a timed command
+      if (command->hasTimeout && isatty(STDIN_FILENO)) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+      }
+
+      // the launcher died before reporting the exit and nothing else can
+      // reap the command now, so stop it rather than leave it running
+      if (waited == -1) {
+        signalGroup(childPID, SIGKILL);
+        printf("Lost track of PID %d, it has been killed \n", childPID);
+        *exitStatus = 1;
+      }
+
+      // report a timeout first since the signal that ended it was ours
+      else if (command->deadline.stage > 0) {
+        printf("Process timed out after %gs \n", command->deadline.timeout);
+        *exitStatus = TIMEOUT_STATUS;
+      }
+
+      // check how it exited and set the exit status variable
+      else if (WIFEXITED(*exitStatus)) {
+        *exitStatus = WEXITSTATUS(*exitStatus);
+      } else {
+        *exitStatus = WTERMSIG(*exitStatus);
+        // if killed by a signal we want to alert the user of which
+        printf("Process killed by signal: %d \n", *exitStatus);
+      }
+    }
+
+    // this is to keep the compiler from complaining
+    return 0;
+  }
+}
+
+// LL initializer
+/******************************************************************************
+ * Function:			createLL
+ * Description:			initate a LL to track bgProcs	
+ * Where:				void
+ *
+ * Return:				head - a bgProc struct representing the head of the LL
+ *****************************************************************************/
+struct bgProc *createLL(void) {
+  struct bgProc *head = malloc(sizeof(struct bgProc));
+
+  head->PID = -1;
+  head->deadline.timerFD = -1;
+  head->next = NULL;
+
+  return head;
+}
+
+// add to LL
+/******************************************************************************
+ * Function:		addBgProc
+ * Description:		adds a background process to the tracking LL
+ * Where:			*head - a pointer to the head of the LL
+ *					newPID - the PID of the process to add
+ *					deadline - the process's (possibly unarmed) deadline
+ * Return:			int representing successful addition
+ *****************************************************************************/
+int addBgProc(struct bgProc *head, int newPID, struct deadline deadline) {
+  // instantiate a new node with the given pid
+  struct bgProc *newProc = malloc(sizeof(struct bgProc));
+  newProc->PID = newPID;
+  newProc->deadline = deadline;
+  newProc->next = NULL;
+
+
+  // iterate to the end of the list
+  while (head->next != NULL) {
+    head = head->next;
+  }
+
+  // attach the new node to the end of the list
+  head->next = newProc;
+
+  metrics.bgProcs++;
+  if (metrics.bgProcs > metrics.bgProcsPeak) {
+    metrics.bgProcsPeak = metrics.bgProcs;
+  }
+
+  // return 1 to indicate success
+  return 1;
+}
+
+// function to print LL PIDS
+/******************************************************************************
+ * Function:		showPIDS 
+ * Description:		a fancy print function for the backgrounded PIDs
+ * Where:			bgProc *head - the head of the bg tracking LL
+ * Return:			void
+ *****************************************************************************/
+void showPIDs(struct bgProc *head) {
+  while (head != NULL) {
+    printf("bPID: %d \n", head->PID);
+    head = head->next;
+  }
+}
+
+// function to remove dead processes from LL
+/******************************************************************************
+ * Function:		removeNext
+ * Description:		given a node removed the the node following it from the 
+ *					proc tracking LL by pointing the current pointer past it
+ * Where:			bgProc * node - the node we want to remove the successor to
+ * Return:			void
+ *****************************************************************************/
+void removeNext(struct bgProc *node) { node->next = node->next->next; }
 
 // function to clear dead processes
 /******************************************************************************
- * Function:		clearDefunct
- * Description:		clears defunct processes from the background cache
- * Where:			bgProc *head - the head of the LL to clear procs from
+ * Function:		clearDefunct
+ * Description:		clears defunct processes from the background cache and
+ *					escalates against any whose deadline has passed
+ * Where:			bgProc *head - the head of the LL to clear procs from
+ * Return:			the number of processes cleared
+ *****************************************************************************/
+int clearDefunct(struct bgProc *head) {
+  // a location to write exit information for waitPID
+  int exitStatus;
+  int cleared = 0;
+  uint64_t reapStart = nowNs();
+	
+  // we know the head of the list has bunk data
+  // we don't want to look at. Set the actual head to the
+  // node immediately following it and set the initial prev
+  // node to head
+  struct bgProc *prev = head;
+  head = head->next;
+	
+  // traverse the list and call waitPID to check if a process has terminated
+  while (head != NULL) {
+    if (head->PID != -1 && head->PID != 1) {
+      int termination = launcherWait(head->PID, &exitStatus, WNOHANG);
+
+      // still running, only now is it safe to signal it if it is overdue
+      if (termination == 0) {
+        checkDeadline(&head->deadline, head->PID);
+      }
+
+	  // if a process has terminated alert the user and let the know the 
+	  // exit status
+      else {
+        if (head->deadline.stage > 0) {
+          printf("Process %d timed out after %gs and will be cleared. Exit "
+                 "Status: %d \n",
+                 head->PID, head->deadline.timeout, TIMEOUT_STATUS);
+        } else {
+          int termStatus = WEXITSTATUS(exitStatus);
+          printf("Process %d successfully completed and will be cleared. Exit "
+                 "Status: %d \n",
+                 head->PID, termStatus);
+        }
+        fflush(stdout);
+        clearDeadline(&head->deadline);
+        removeNext(prev);
+        free(head);
+        cleared++;
+        metrics.bgProcs--;
+
+        // prev now links to the next node so stay put
+        head = prev->next;
+        continue;
+      }
+    }
+	
+	// continue on until we reach the end of the loop
+    prev = head;
+    head = head->next;
+  }
+
+  histRecord(&metrics.reap, reapStart);
+  return cleared;
+}
+
+/* The prompt reads the terminal with read() into its own buffer rather than
+ * through stdio, so that polling fd 0 next to the timers is always accurate:
+ * there is never input hidden in a FILE buffer that poll() can't see. */
+
+// input read from the terminal that hasn't been handed out as a line yet
+char inputBuffer[2048];
+int inputUsed = 0;
+int inputEOF = 0;
+
+/******************************************************************************
+ * Function:		inputReady
+ * Description:		checks whether takeLine can return without reading
+ * Where:			void
+ * Return:			1 if a whole line (or end of input) is buffered otherwise 0
+ *****************************************************************************/
+int inputReady(void) {
+  return inputEOF || inputUsed == sizeof(inputBuffer) ||
+         memchr(inputBuffer, '\n', inputUsed) != NULL;
+}
+
+/******************************************************************************
+ * Function:		readInput
+ * Description:		reads whatever the terminal has available into the input
+ *					buffer, noting end of input
+ * Where:			void
+ * Return:			void
+ *****************************************************************************/
+void readInput(void) {
+  ssize_t len = read(STDIN_FILENO, inputBuffer + inputUsed,
+                     sizeof(inputBuffer) - inputUsed);
+
+  if (len > 0) {
+    inputUsed += len;
+  } else if (len == 0 || errno != EINTR) {
+    inputEOF = 1;
+  }
+}
+
+/******************************************************************************
+ * Function:		takeLine
+ * Description:		hands out the next buffered line including its newline,
+ *					splitting lines too long for the caller's buffer as
+ *					fgets would
+ * Where:			char *line - where to copy the line
+ *					int size - the size of line
+ * Return:			1 if a line was copied or 0 at the end of input
+ *****************************************************************************/
+int takeLine(char *line, int size) {
+  if (inputUsed == 0) {
+    return 0;
+  }
+
+  char *newline = memchr(inputBuffer, '\n', inputUsed);
+  int len = newline != NULL ? newline - inputBuffer + 1 : inputUsed;
+  if (len > size - 1) {
+    len = size - 1;
+  }
+
+  memcpy(line, inputBuffer, len);
+  line[len] = '\0';
+  inputUsed -= len;
+  memmove(inputBuffer, inputBuffer + len, inputUsed);
+
+  return 1;
+}
+
+/******************************************************************************
+ * Function:		waitForInput
+ * Description:		reads the terminal until a line is ready while keeping
+ *					background deadlines and the metrics dump running at
+ *					the prompt. Whenever a timer fires the background list
+ *					is reaped and escalated.
+ * Where:			bgProc *head - the head of the background LL
+ *					char *prompt - the prompt to show again if jobs were
+ *					reported while waiting
+ * Return:			void
+ *****************************************************************************/
+void waitForInput(struct bgProc *head, char *prompt) {
+  while (!inputReady()) {
+    int nfds = 2;
+    for (struct bgProc *node = head; node != NULL; node = node->next) {
+      nfds += node->deadline.timerFD != -1;
+    }
+
+    // room for stdin, the metrics dump, every deadline and an exit watcher
+    // per deadline
+    struct pollfd fds[2 * nfds];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = metricsDumpFD;
+    fds[1].events = POLLIN;
+    nfds = 2;
+    for (struct bgProc *node = head; node != NULL; node = node->next) {
+      if (node->deadline.timerFD != -1) {
+        fds[nfds].fd = node->deadline.timerFD;
+        fds[nfds++].events = POLLIN;
+      }
+    }
+
+    // once a process has been signalled also wake when it exits so it is
+    // reported straight away: through its pidfd, or the launcher socket
+    // when the launcher started it
+    int timerEnd = nfds;
+    for (struct bgProc *node = head; node != NULL; node = node->next) {
+      if (node->deadline.timerFD != -1 && node->deadline.stage > 0) {
+        fds[nfds].fd = zygoteFD;
+        if (zygoteFind(node->PID) == NULL) {
+          fds[nfds].fd = syscall(SYS_pidfd_open, node->PID, 0);
+        }
+        fds[nfds++].events = POLLIN;
+      }
+    }
+
+    int ready = poll(fds, nfds, -1);
+
+    for (int i = timerEnd; i < nfds; i++) {
+      if (fds[i].fd != zygoteFD && fds[i].fd != -1) {
+        close(fds[i].fd);
+      }
+    }
+
+    // e.g. ^Z's SIGTSTP handler, just go round again
+    if (ready == -1) {
+      continue;
+    }
+
+    if (fds[0].revents != 0) {
+      readInput();
+    }
+
+    if (fds[1].revents != 0) {
+      metricsDump();
+    }
+
+    int fired = 0;
+    for (int i = 2; i < nfds; i++) {
+      fired |= fds[i].revents != 0;
+    }
+
+    if (fired) {
+      zygoteDrain();
+      if (clearDefunct(head) > 0) {
+        write(STDOUT_FILENO, prompt, 2);
+      }
+    }
+  }
+}
+
+/******************************************************************************
+ * Function:         void exitShell
+ * Description:      exits the shell
+ * Where:
+ *					 struct bgProc *head - the head of the list of background processes 
+ * Return:           returns 0 to connote successful exiting 
+ *****************************************************************************/
+void exitShell(struct bgProc *head) {
+  while (head != NULL) {
+	// we have to kill all bgprocs before we exit
+    if (head->PID != 1 && head->PID != -1) {
+      signalGroup(head->PID, SIGKILL);
+    }
+    head = head->next;
+  }
+
+  // once they're all dead we can just call exit
+  exit(0);
+}
+
+// Function to handle SIGTSTP
+/******************************************************************************
+ * Function:		handle_SIGTSTP
+ * Description:		a handler for the SIGTSTP signal that toggles global foreground
+ *					mode.
+ * Where:			int signo - the signal being recieved
+ *
+ * Return:			void
+ *****************************************************************************/
+void handle_SIGTSTP(int signo) {
+
+	// if the FG_only flag is set to false toggle it to true and let the user know
+	// the mode has changed.
+  if (FG_only == 0) {
+    char *message = "Entering foreground-only mode (& is now ignored)\n";
+    write(STDOUT_FILENO, message, 50);
+    FG_only = 1;
+  } 
+
+	// if the FG_only flag is set to true toggle it to false eand let the user know
+	// the mode has changed.
+  else {
+    char *message = "Exiting foreground-only mode\n";
+    write(STDOUT_FILENO, message, 29);
+    FG_only = 0;
+  }
+}
+
+/* Serve mode (smallsh --serve SOCKET) turns one long-lived shell into a
+ * command server so callers don't pay for a fresh shell per command.
+ * Clients connect to a unix stream socket and send command lines, one per
+ * line. Each line is queued, started through executeInput() as a background
+ * command once fewer than --jobs commands are running, and answered once it
+ * has finished:
+ *
+ *		QUEUED <id>
+ *		OUTPUT <id> <length>\n<length bytes>		(only after .capture on)
+ *		DONE <id> exit|signal|timeout <status> queue_us=<n> run_us=<n>
+ *
+ * Lines starting with a dot are requests to the server itself:
+ *
+ *		.capture on|off		stream back stdout and stderr of later commands
+ *		.stats				queue depth, job counts and latency counters
+ *		.metrics			METRICS <length>\n then the metrics builtin's
+ *							output
+ *
+ * Replies are queued per client and written as its socket accepts them, so
+ * the server never blocks on a client. While a client has more than
+ * SERVE_BACKLOG_HIGH bytes waiting the server stops reading its requests
+ * and its commands' output, and a client whose backlog still grows past
+ * SERVE_BACKLOG_MAX is disconnected. */
+
+// longest command line accepted, the same as at the prompt
+#define SERVE_LINE_MAX 2048
+// unsent reply bytes at which a client stops being read from
+#define SERVE_BACKLOG_HIGH (64 * 1024)
+// unsent reply bytes at which a client is given up on
+#define SERVE_BACKLOG_MAX (4 * 1024 * 1024)
+
+/* a connected client
+ * Includes:
+ *			int FD			the client's socket
+ *			int capture		whether new commands should have their output
+ *							streamed back
+ *			int dead		set once the client has hung up or a send failed,
+ *							the client is freed at the end of the loop
+ *			int discarding	set while skipping the rest of an overlong line
+ *			char buffer[]	a partial line received so far
+ *			char *out		replies the socket has not accepted yet, outUsed
+ *							bytes of an allocation of outSize
+ * */
+struct serveClient {
+  int FD;
+  int capture;
+  int dead;
+  int discarding;
+  int used;
+  char buffer[SERVE_LINE_MAX];
+  char *out;
+  size_t outUsed;
+  size_t outSize;
+  struct serveClient *next;
+};
+
+/* a command submitted by a client
+ * Includes:
+ *			struct serveClient *client	who to reply to, NULL once they hung up
+ *			pid_t PID		the running command or 0 if nothing was started
+ *			int pidFD		a pidfd for PID, or -1
+ *			int outFD		the read end of the capture pipe, or -1
+ *			int exited		set once PID has been reaped, status then holds
+ *							its raw waitpid() status
+ *			queued/started	when the line arrived and when it was started
+ * */
+struct serveJob {
+  int id;
+  struct serveClient *client;
+  char line[SERVE_LINE_MAX];
+  pid_t PID;
+  int pidFD;
+  int outFD;
+  int exited;
+  int status;
+  struct deadline deadline;
+  struct timespec queued;
+  struct timespec started;
+  struct serveJob *next;
+};
+
+/* the counters reported by .stats, latencies are in microseconds */
+struct serveStats {
+  long queued;
+  long running;
+  long completed;
+  long long queueUsTotal;
+  long long queueUsMax;
+  long long runUsTotal;
+  long long runUsMax;
+};
+
+struct serveClient *serveClients = NULL;
+struct serveJob *serveQueue = NULL;
+struct serveJob *serveRunning = NULL;
+struct serveStats serveStats = {0};
+int serveNextID = 1;
+// how many jobs may run at once, 0 until the server is running
+int serveMaxJobs = 0;
+
+/******************************************************************************
+ * Function:        elapsedUs
+ * Description:		the microseconds between two CLOCK_MONOTONIC readings
+ * Where:			- struct timespec *from - the earlier reading
+ *					- struct timespec *to - the later reading
+ * Return:			the elapsed microseconds
+ *****************************************************************************/
+long long elapsedUs(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000LL +
+         (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/******************************************************************************
+ * Function:        serveWrite
+ * Description:		writes as much as the client's socket will take without
+ *					blocking, marking the client dead on failure
+ * Where:			- struct serveClient *client - the client to send to
+ *					- const char *data - the bytes to send
+ *					- size_t len - how many bytes to send
+ * Return:			how many bytes were sent
+ *****************************************************************************/
+size_t serveWrite(struct serveClient *client, const char *data, size_t len) {
+  size_t total = 0;
+
+  while (total < len && !client->dead) {
+    ssize_t sent = send(client->FD, data + total, len - total,
+                        MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (sent == -1 && errno == EINTR) {
+      continue;
+    }
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (sent == -1) {
+      client->dead = 1;
+      break;
+    }
+
+    total += sent;
+  }
+
+  return total;
+}
+
+/******************************************************************************
+ * Function:        serveSend
+ * Description:		sends bytes to a client, queueing whatever its socket
+ *					will not take yet behind anything already queued
+ * Where:			- struct serveClient *client - the client to send to
+ *					- const char *data - the bytes to send
+ *					- size_t len - how many bytes to send
+ * Return:			void
+ *****************************************************************************/
+void serveSend(struct serveClient *client, const char *data, size_t len) {
+  // only write straight away when that cannot overtake queued bytes
+  if (client->outUsed == 0) {
+    size_t sent = serveWrite(client, data, len);
+    data += sent;
+    len -= sent;
+  }
+
+  if (len == 0 || client->dead) {
+    return;
+  }
+
+  if (client->outUsed + len > SERVE_BACKLOG_MAX) {
+    client->dead = 1;
+    return;
+  }
+
+  if (client->outUsed + len > client->outSize) {
+    size_t size = client->outSize ? client->outSize : 4096;
+    while (size < client->outUsed + len) {
+      size *= 2;
+    }
+    client->out = realloc(client->out, size);
+    client->outSize = size;
+  }
+
+  memcpy(client->out + client->outUsed, data, len);
+  client->outUsed += len;
+}
+
+/******************************************************************************
+ * Function:        serveFlush
+ * Description:		sends as much of a client's queued replies as its socket
+ *					will take now
+ * Where:			- struct serveClient *client - the writable client
+ * Return:			void
+ *****************************************************************************/
+void serveFlush(struct serveClient *client) {
+  size_t sent = serveWrite(client, client->out, client->outUsed);
+
+  client->outUsed -= sent;
+  memmove(client->out, client->out + sent, client->outUsed);
+}
+
+/******************************************************************************
+ * Function:        serveReply
+ * Description:		printf style wrapper around serveSend for reply lines
+ * Where:			- struct serveClient *client - the client to reply to
+ *					- const char *format - the printf format of the reply
+ * Return:			void
+ *****************************************************************************/
+void serveReply(struct serveClient *client, const char *format, ...) {
+  char reply[512];
+  va_list args;
+
+  va_start(args, format);
+  int len = vsnprintf(reply, sizeof(reply), format, args);
+  va_end(args);
+
+  // replies that echo a client's line can be longer, format those again
+  // into a buffer of the size vsnprintf asked for
+  if (len >= (int)sizeof(reply)) {
+    char *longReply = malloc(len + 1);
+    va_start(args, format);
+    vsnprintf(longReply, len + 1, format, args);
+    va_end(args);
+
+    serveSend(client, longReply, len);
+    free(longReply);
+  }
+
+  else if (len > 0) {
+    serveSend(client, reply, len);
+  }
+}
+
+/******************************************************************************
+ * Function:        serveRequest
+ * Description:		handles one line from a client: either a dot request to
+ *					the server or a command line to queue
+ * Where:			- struct serveClient *client - the client that sent it
+ *					- char *line - the line without its newline
+ * Return:			void
+ *****************************************************************************/
+void serveRequest(struct serveClient *client, char *line) {
+  if (line[0] == '\0') {
+    return;
+  }
+
+  if (strcmp(line, ".capture on") == 0 || strcmp(line, ".capture off") == 0) {
+    client->capture = strcmp(line, ".capture on") == 0;
+    serveReply(client, "OK\n");
+  }
+
+  else if (strcmp(line, ".metrics") == 0) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    metricsWrite(out);
+    fclose(out);
+    serveReply(client, "METRICS %zu\n", len);
+    serveSend(client, text, len);
+    free(text);
+  }
+
+  else if (strcmp(line, ".stats") == 0) {
+    long long finished = serveStats.completed ? serveStats.completed : 1;
+    long long started = serveStats.completed + serveStats.running;
+    serveReply(client,
+               "STATS queued=%ld running=%ld completed=%ld cap=%d "
+               "queue_us_avg=%lld queue_us_max=%lld "
+               "run_us_avg=%lld run_us_max=%lld\n",
+               serveStats.queued, serveStats.running, serveStats.completed,
+               serveMaxJobs, serveStats.queueUsTotal / (started ? started : 1),
+               serveStats.queueUsMax, serveStats.runUsTotal / finished,
+               serveStats.runUsMax);
+  }
+
+  else if (line[0] == '.') {
+    serveReply(client, "ERR unknown request %s\n", line);
+  }
+
+  // anything else is a command line, add it to the back of the queue
+  else {
+    struct serveJob *job = calloc(1, sizeof(struct serveJob));
+    job->id = serveNextID++;
+    job->client = client;
+    strcpy(job->line, line);
+    clock_gettime(CLOCK_MONOTONIC, &job->queued);
+
+    struct serveJob **tail = &serveQueue;
+    while (*tail != NULL) {
+      tail = &(*tail)->next;
+    }
+    *tail = job;
+    serveStats.queued++;
+
+    serveReply(client, "QUEUED %d\n", job->id);
+  }
+}
+
+/******************************************************************************
+ * Function:        serveStart
+ * Description:		parses a queued job's line and starts it as a background
+ *					command through executeInput
+ * Where:			- struct serveJob *job - the job to start
+ *					- sigaction INTact - the shell's SIGINT sigaction
+ *					- sigaction STPact - the shell's SIGTSTP sigaction
+ * Return:			void
+ *****************************************************************************/
+void serveStart(struct serveJob *job, struct sigaction INTact,
+                struct sigaction STPact) {
+  int exitStatus = 0;
+
+  job->pidFD = -1;
+  job->outFD = -1;
+  job->deadline.timerFD = -1;
+  clock_gettime(CLOCK_MONOTONIC, &job->started);
+
+  long long queueUs = elapsedUs(&job->queued, &job->started);
+  serveStats.queueUsTotal += queueUs;
+  if (queueUs > serveStats.queueUsMax) {
+    serveStats.queueUsMax = queueUs;
+  }
+
+  uint64_t parseStart = nowNs();
+  struct procObj *command = createInputObject(job->line);
+  histRecord(&metrics.parse, parseStart);
+
+  // strip timeout prefixes here rather than leaving them to executeInput
+  // so the builtin check below sees the command that will really run.
+  // timeout -b would change the background default for every client
+  char *rejected = NULL;
+  int runnable = command->command != NULL && command->error == NULL;
+
+  // a line that did not parse is refused before anything else looks at it
+  if (command->error != NULL) {
+    if (job->client != NULL) {
+      serveReply(job->client, "ERR %d %s\n", job->id, command->error);
+    }
+    exitStatus = 1;
+  }
+  while (runnable && rejected == NULL &&
+         strcmp(command->command, "timeout") == 0) {
+    if (command->args[1] != NULL && strcmp(command->args[1], "-b") == 0) {
+      rejected = "timeout -b";
+    } else {
+      runnable = applyTimeout(command, &exitStatus);
+    }
+  }
+
+  // builtins that act on the shell itself would act on every client
+  if (runnable && rejected == NULL &&
+      (strcmp(command->command, "cd") == 0 ||
+       strcmp(command->command, "exit") == 0 ||
+       strcmp(command->command, "status") == 0)) {
+    rejected = command->command;
+  }
+
+  if (rejected != NULL) {
+    if (job->client != NULL) {
+      serveReply(job->client, "ERR %d %s is not supported in serve mode\n",
+                 job->id, rejected);
+    }
+    exitStatus = 1;
+  }
+
+  else if (runnable) {
+    command->background = 1;
+
+    int pipeFDs[2];
+    if (job->client != NULL && job->client->capture &&
+        pipe2(pipeFDs, O_CLOEXEC) == 0) {
+      command->captureFD = pipeFDs[1];
+      job->outFD = pipeFDs[0];
+    }
+
+    job->PID = executeInput(command, &exitStatus, INTact, STPact);
+    job->deadline = command->deadline;
+
+    if (command->captureFD != -1) {
+      close(command->captureFD);
+    }
+  }
+
+  // the child has its own copy (or the launcher was sent one) by now
+  freeInputObject(command);
+
+  // nothing was started, report whatever status the attempt left behind
+  if (job->PID <= 0) {
+    if (job->outFD != -1) {
+      close(job->outFD);
+      job->outFD = -1;
+    }
+    job->PID = 0;
+    job->exited = 1;
+    job->status = W_EXITCODE(exitStatus, 0);
+  }
+
+  // with the launcher running its socket reports exits instead
+  else if (zygoteFind(job->PID) == NULL) {
+    job->pidFD = syscall(SYS_pidfd_open, job->PID, 0);
+  }
+}
+
+/******************************************************************************
+ * Function:        serveFinish
+ * Description:		records a finished job in the stats and tells its client
+ * Where:			- struct serveJob *job - the job that has finished
  * Return:			void
  *****************************************************************************/
-void clearDefunct(struct bgProc *head) {
-  // a location to write exit information for waitPID
-  int exitStatus;
-	
-  // we know the head of the list has bunk data
-  // we don't want to look at. Set the actual head to the
-  // node immediately following it and set the initial prev
-  // node to head
-  struct bgProc *prev = head;
-  head = head->next;
-	
-  // traverse the list and call waitPID to check if a process has terminated
-  while (head != NULL) {
-    if (head->PID != -1 && head->PID != 1) {
-      int termination = waitpid(head->PID, &exitStatus, WNOHANG);
+void serveFinish(struct serveJob *job) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  long long runUs = elapsedUs(&job->started, &now);
+  serveStats.runUsTotal += runUs;
+  if (runUs > serveStats.runUsMax) {
+    serveStats.runUsMax = runUs;
+  }
+  serveStats.completed++;
 
-	  // if a process has terminated alert the user and let the know the 
-	  // exit status
-      if (termination != 0) {
-        int termStatus = WEXITSTATUS(exitStatus);
-        printf("Process %d successfully completed and will be cleared. Exit "
-               "Status: %d \n",
-               head->PID, termStatus);
-        removeNext(prev);
+  if (job->client == NULL) {
+    return;
+  }
+
+  char *kind = "exit";
+  int status = 0;
+  if (job->deadline.stage > 0) {
+    kind = "timeout";
+    status = TIMEOUT_STATUS;
+  } else if (WIFEXITED(job->status)) {
+    status = WEXITSTATUS(job->status);
+  } else {
+    kind = "signal";
+    status = WTERMSIG(job->status);
+  }
+
+  serveReply(job->client, "DONE %d %s %d queue_us=%lld run_us=%lld\n",
+             job->id, kind, status, elapsedUs(&job->queued, &job->started),
+             runUs);
+}
+
+/******************************************************************************
+ * Function:        serveReap
+ * Description:		collects exits of running jobs, escalates any that are
+ *					past their deadline, and retires jobs that have both
+ *					exited and had all their output forwarded. Timed out
+ *					jobs are retired as soon as they have exited.
+ * Where:			void
+ * Return:			the number of jobs retired
+ *****************************************************************************/
+int serveReap(void) {
+  int retired = 0;
+  uint64_t reapStart = nowNs();
+  struct serveJob **link = &serveRunning;
+
+  while (*link != NULL) {
+    struct serveJob *job = *link;
+
+    if (!job->exited) {
+      if (launcherWait(job->PID, &job->status, WNOHANG) != 0) {
+        job->exited = 1;
+      } else {
+        checkDeadline(&job->deadline, job->PID);
       }
     }
-	
-	// continue on until we reach the end of the loop
-    prev = head;
-    head = head->next;
+
+    // a timed out command is done once it has gone, whatever it left
+    // behind holding the capture pipe open gets no more of the client
+    if (job->exited && job->deadline.stage > 0 && job->outFD != -1) {
+      close(job->outFD);
+      job->outFD = -1;
+    }
+
+    if (!job->exited || job->outFD != -1) {
+      link = &job->next;
+      continue;
+    }
+
+    serveFinish(job);
+    clearDeadline(&job->deadline);
+    if (job->pidFD != -1) {
+      close(job->pidFD);
+    }
+
+    *link = job->next;
+    free(job);
+    serveStats.running--;
+    retired++;
   }
+
+  histRecord(&metrics.reap, reapStart);
+  return retired;
 }
 
 /******************************************************************************
- * Function:         void exitShell
- * Description:      exits the shell
- * Where:
- *					 struct bgProc *head - the head of the list of background processes 
- * Return:           returns 0 to connote successful exiting 
+ * Function:        serveRead
+ * Description:		reads what a client has sent and handles each complete
+ *					line, marking the client dead once it hangs up
+ * Where:			- struct serveClient *client - the readable client
+ * Return:			void
  *****************************************************************************/
-void exitShell(struct bgProc *head) {
-  while (head != NULL) {
-	// we have to kill all bgprocs before we exit
-    if (head->PID != 1 && head->PID != -1) {
-      kill(head->PID, SIGKILL);
+void serveRead(struct serveClient *client) {
+  ssize_t len = read(client->FD, client->buffer + client->used,
+                     sizeof(client->buffer) - client->used);
+
+  if (len <= 0) {
+    if (len == 0 || (errno != EINTR && errno != EAGAIN)) {
+      client->dead = 1;
     }
-    head = head->next;
+    return;
+  }
+  client->used += len;
+
+  // hand over each complete line, tolerating \r\n line endings
+  char *start = client->buffer;
+  char *end = client->buffer + client->used;
+  char *newline;
+  while ((newline = memchr(start, '\n', end - start)) != NULL) {
+    *newline = '\0';
+    if (newline > start && newline[-1] == '\r') {
+      newline[-1] = '\0';
+    }
+    if (!client->discarding) {
+      serveRequest(client, start);
+    }
+    client->discarding = 0;
+    start = newline + 1;
   }
 
-  // once they're all dead we can just call exit
-  exit(0);
+  client->used = end - start;
+  memmove(client->buffer, start, client->used);
+
+  // a full buffer with no newline can never become a valid line
+  if (client->used == sizeof(client->buffer)) {
+    if (!client->discarding) {
+      serveReply(client, "ERR line too long\n");
+    }
+    client->discarding = 1;
+    client->used = 0;
+  }
 }
 
-// Function to handle SIGTSTP
 /******************************************************************************
- * Function:		handle_SIGTSTP
- * Description:		a handler for the SIGTSTP signal that toggles global foreground
- *					mode.
- * Where:			int signo - the signal being recieved
- *
+ * Function:        serveForward
+ * Description:		forwards a chunk of captured output to the job's client,
+ *					closing the pipe once the command has closed its end
+ * Where:			- struct serveJob *job - the job with readable output
  * Return:			void
  *****************************************************************************/
-void handle_SIGTSTP(int signo) {
+void serveForward(struct serveJob *job) {
+  char chunk[4096];
+  ssize_t len = read(job->outFD, chunk, sizeof(chunk));
+
+  if (len <= 0) {
+    if (len == 0 || errno != EINTR) {
+      close(job->outFD);
+      job->outFD = -1;
+    }
+    return;
+  }
 
-	// if the FG_only flag is set to false toggle it to true and let the user know
-	// the mode has changed.
-  if (FG_only == 0) {
-    char *message = "Entering foreground-only mode (& is now ignored)\n";
-    write(STDOUT_FILENO, message, 50);
-    FG_only = 1;
-  } 
+  if (job->client != NULL) {
+    serveReply(job->client, "OUTPUT %d %zd\n", job->id, len);
+    serveSend(job->client, chunk, len);
+  }
+}
+
+/******************************************************************************
+ * Function:        serveDrop
+ * Description:		frees clients that have hung up, detaching their running
+ *					jobs and dropping the jobs they still had queued
+ * Where:			void
+ * Return:			void
+ *****************************************************************************/
+void serveDrop(void) {
+  struct serveClient **link = &serveClients;
+
+  while (*link != NULL) {
+    struct serveClient *client = *link;
+    if (!client->dead) {
+      link = &client->next;
+      continue;
+    }
+
+    for (struct serveJob *job = serveRunning; job != NULL; job = job->next) {
+      if (job->client == client) {
+        job->client = NULL;
+      }
+    }
+
+    struct serveJob **jobLink = &serveQueue;
+    while (*jobLink != NULL) {
+      struct serveJob *job = *jobLink;
+      if (job->client == client) {
+        *jobLink = job->next;
+        free(job);
+        serveStats.queued--;
+      } else {
+        jobLink = &job->next;
+      }
+    }
+
+    close(client->FD);
+    *link = client->next;
+    free(client->out);
+    free(client);
+  }
+}
+
+/******************************************************************************
+ * Function:        serveListen
+ * Description:		binds and listens on a unix stream socket, replacing a
+ *					stale socket file left behind by an earlier server
+ * Where:			- char *path - where to create the socket
+ * Return:			the listening socket or -1 on failure
+ *****************************************************************************/
+int serveListen(char *path) {
+  struct sockaddr_un addr = {0};
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "serve: socket path too long: %s\n", path);
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenFD == -1) {
+    perror("serve socket()");
+    return -1;
+  }
+
+  // only replace the socket file if nothing is listening on it any more
+  struct stat info;
+  if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+    if (connect(listenFD, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      fprintf(stderr, "serve: %s is already in use\n", path);
+      close(listenFD);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  if (bind(listenFD, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listenFD, SOMAXCONN) == -1) {
+    perror("serve bind()");
+    close(listenFD);
+    return -1;
+  }
+
+  return listenFD;
+}
+
+/******************************************************************************
+ * Function:        serveMain
+ * Description:		the serve mode event loop: accepts clients, reads their
+ *					requests, starts queued jobs as slots free up, forwards
+ *					captured output and reports jobs as they finish
+ * Where:			- char *path - where to create the socket
+ *					- int maxJobs - how many commands may run at once
+ *					- sigaction INTact - the shell's SIGINT sigaction
+ *					- sigaction STPact - the shell's SIGTSTP sigaction
+ * Return:			only returns if the socket could not be created
+ *****************************************************************************/
+void serveMain(char *path, int maxJobs, struct sigaction INTact,
+               struct sigaction STPact) {
+  int listenFD = serveListen(path);
+  if (listenFD == -1) {
+    return;
+  }
+
+  serveMode = 1;
+  serveMaxJobs = maxJobs;
+  printf("serving on %s with up to %d jobs \n", path, maxJobs);
+  fflush(stdout);
+
+  while (1) {
+    // start queued jobs while there are free slots, anything that finished
+    // straight away frees its slot again
+    do {
+      while (serveQueue != NULL && serveStats.running < serveMaxJobs) {
+        struct serveJob *job = serveQueue;
+        serveQueue = job->next;
+        serveStats.queued--;
+
+        job->next = serveRunning;
+        serveRunning = job;
+        serveStats.running++;
+        serveStart(job, INTact, STPact);
+      }
+    } while (serveReap() > 0);
+
+    serveDrop();
+
+    // listener, launcher, metrics dump, clients, then per job: output,
+    // deadline and exit watcher
+    int nfds = 3;
+    for (struct serveClient *client = serveClients; client; client = client->next) {
+      nfds++;
+    }
+    for (struct serveJob *job = serveRunning; job != NULL; job = job->next) {
+      nfds += 3;
+    }
+
+    struct pollfd fds[nfds];
+    int tick = 0;
+    nfds = 0;
+    fds[nfds].fd = listenFD;
+    fds[nfds++].events = POLLIN;
+    fds[nfds].fd = zygoteFD;
+    fds[nfds++].events = POLLIN;
+    fds[nfds].fd = metricsDumpFD;
+    fds[nfds++].events = POLLIN;
+
+    // a client with a backlog is only written to until it catches up, and
+    // its commands are left blocked on their capture pipes meanwhile
+    for (struct serveClient *client = serveClients; client; client = client->next) {
+      fds[nfds].fd = client->FD;
+      fds[nfds].events = client->outUsed > 0 ? POLLOUT : 0;
+      if (client->outUsed < SERVE_BACKLOG_HIGH) {
+        fds[nfds].events |= POLLIN;
+      }
+      nfds++;
+    }
+    for (struct serveJob *job = serveRunning; job != NULL; job = job->next) {
+      int backlogged = job->client != NULL &&
+                       job->client->outUsed >= SERVE_BACKLOG_HIGH;
+      fds[nfds].fd = backlogged ? -1 : job->outFD;
+      fds[nfds++].events = POLLIN;
+      fds[nfds].fd = job->deadline.timerFD;
+      fds[nfds++].events = POLLIN;
+      fds[nfds].fd = job->exited ? -1 : job->pidFD;
+      fds[nfds++].events = POLLIN;
+
+      // without a pidfd or the launcher check for the exit every 100ms
+      tick |= !job->exited && job->pidFD == -1 &&
+              zygoteFind(job->PID) == NULL;
+    }
+
+    if (poll(fds, nfds, tick ? 100 : -1) == -1) {
+      continue;
+    }
+
+    if (fds[2].revents != 0) {
+      metricsDump();
+    }
+
+    // walk the lists in the same order they were added to fds
+    nfds = 3;
+    for (struct serveClient *client = serveClients; client; client = client->next) {
+      if (fds[nfds].revents & POLLOUT) {
+        serveFlush(client);
+      }
+      if (fds[nfds].revents & (POLLIN | POLLHUP | POLLERR)) {
+        serveRead(client);
+      }
+      nfds++;
+    }
+    for (struct serveJob *job = serveRunning; job != NULL; job = job->next) {
+      if (fds[nfds].revents != 0) {
+        serveForward(job);
+      }
+      nfds += 3;
+    }
+
+    if (fds[1].revents != 0) {
+      zygoteDrain();
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int clientFD = accept4(listenFD, NULL, NULL,
+                             SOCK_CLOEXEC | SOCK_NONBLOCK);
+      if (clientFD != -1) {
+        struct serveClient *client = calloc(1, sizeof(struct serveClient));
+        client->FD = clientFD;
+        client->next = serveClients;
+        serveClients = client;
+      }
+    }
+  }
+}
+
+/******************************************************************************
+ * Function:        histWrite
+ * Description:		writes a histogram in the Prometheus text format, in
+ *					seconds. The same power of two ladder of bounds is
+ *					listed every time, empty or not, so series stay stable.
+ * Where:			- FILE *out - where to write
+ *					- char *name - the metric name
+ *					- char *help - the metric's help text
+ *					- struct histogram *hist - the histogram to write
+ * Return:			void
+ *****************************************************************************/
+void histWrite(FILE *out, char *name, char *help, struct histogram *hist) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+  // every power of two starts one of our buckets, so the count below it
+  // is exact. Our bounds are exclusive and Prometheus' inclusive, with
+  // whole nanoseconds the two differ by one
+  uint64_t cumulative = 0;
+  int i = 0;
+  for (int power = HIST_LADDER_MIN; power <= HIST_LADDER_MAX; power++) {
+    uint64_t bound = 1ULL << power;
+    for (; i < histIndex(bound); i++) {
+      cumulative += hist->counts[i];
+    }
+    fprintf(out, "%s_bucket{le=\"%.10g\"} %llu\n", name, (bound - 1) / 1e9,
+            (unsigned long long)cumulative);
+  }
+
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+          (unsigned long long)hist->count);
+  fprintf(out, "%s_sum %.9f\n", name, hist->sum / 1e9);
+  fprintf(out, "%s_count %llu\n", name, (unsigned long long)hist->count);
+  fprintf(out, "# HELP %s_max Longest observation.\n# TYPE %s_max gauge\n"
+          "%s_max %.9f\n", name, name, name, hist->max / 1e9);
+}
+
+/******************************************************************************
+ * Function:        residentBytes
+ * Description:		the shell's current resident set size
+ * Where:			void
+ * Return:			the resident set in bytes or -1 if /proc is unavailable
+ *****************************************************************************/
+long residentBytes(void) {
+  long pages = -1;
+  FILE *statm = fopen("/proc/self/statm", "r");
+
+  if (statm != NULL) {
+    if (fscanf(statm, "%*s %ld", &pages) != 1) {
+      pages = -1;
+    }
+    fclose(statm);
+  }
+
+  return pages == -1 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+/******************************************************************************
+ * Function:        openFDs
+ * Description:		counts the shell's open file descriptors
+ * Where:			void
+ * Return:			the count or -1 if /proc is unavailable
+ *****************************************************************************/
+int openFDs(void) {
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == NULL) {
+    return -1;
+  }
+
+  // skip . and .. as well as the descriptor opendir itself holds
+  int count = -3;
+  while (readdir(dir) != NULL) {
+    count++;
+  }
+  closedir(dir);
+
+  return count;
+}
+
+/******************************************************************************
+ * Function:        metricsWrite
+ * Description:		writes every metric in the Prometheus text format
+ * Where:			FILE *out - where to write
+ * Return:			void
+ *****************************************************************************/
+void metricsWrite(FILE *out) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  histWrite(out, "nosh_parse_seconds", "Time spent parsing command lines.",
+            &metrics.parse);
+  histWrite(out, "nosh_spawn_seconds",
+            "Time from launch request until the command's PID is known.",
+            &metrics.spawn);
+  histWrite(out, "nosh_wait_seconds",
+            "Time spent waiting for foreground commands.", &metrics.wait);
+  histWrite(out, "nosh_reap_seconds",
+            "Time spent clearing finished background commands.",
+            &metrics.reap);
+
+  fprintf(out,
+          "# HELP nosh_parse_allocations_total Allocations made while parsing.\n"
+          "# TYPE nosh_parse_allocations_total counter\n"
+          "nosh_parse_allocations_total %llu\n"
+          "# HELP nosh_parse_allocated_bytes_total Bytes allocated while parsing.\n"
+          "# TYPE nosh_parse_allocated_bytes_total counter\n"
+          "nosh_parse_allocated_bytes_total %llu\n",
+          (unsigned long long)metrics.parseAllocs,
+          (unsigned long long)metrics.parseAllocBytes);
+
+  fprintf(out,
+          "# HELP nosh_spawns_total Commands started, by launch path.\n"
+          "# TYPE nosh_spawns_total counter\n"
+          "nosh_spawns_total{via=\"fork\"} %llu\n"
+          "nosh_spawns_total{via=\"zygote\"} %llu\n"
+          "# HELP nosh_timeouts_total Commands stopped by their deadline.\n"
+          "# TYPE nosh_timeouts_total counter\n"
+          "nosh_timeouts_total %llu\n",
+          (unsigned long long)metrics.forkSpawns,
+          (unsigned long long)metrics.zygoteSpawns,
+          (unsigned long long)metrics.timeouts);
+
+  fprintf(out,
+          "# HELP nosh_bg_procs Background commands being tracked.\n"
+          "# TYPE nosh_bg_procs gauge\n"
+          "nosh_bg_procs %ld\n"
+          "# HELP nosh_bg_procs_peak Most background commands tracked at once.\n"
+          "# TYPE nosh_bg_procs_peak gauge\n"
+          "nosh_bg_procs_peak %ld\n",
+          metrics.bgProcs, metrics.bgProcsPeak);
+
+  fprintf(out,
+          "# HELP nosh_resident_bytes Current resident set size.\n"
+          "# TYPE nosh_resident_bytes gauge\n"
+          "nosh_resident_bytes %ld\n"
+          "# HELP nosh_resident_peak_bytes Peak resident set size.\n"
+          "# TYPE nosh_resident_peak_bytes gauge\n"
+          "nosh_resident_peak_bytes %ld\n"
+          "# HELP nosh_open_fds Open file descriptors.\n"
+          "# TYPE nosh_open_fds gauge\n"
+          "nosh_open_fds %d\n",
+          residentBytes(), usage.ru_maxrss * 1024, openFDs());
+
+  if (serveMaxJobs > 0) {
+    fprintf(out,
+            "# HELP nosh_serve_queued Jobs waiting for a free slot.\n"
+            "# TYPE nosh_serve_queued gauge\n"
+            "nosh_serve_queued %ld\n"
+            "# HELP nosh_serve_running Jobs currently running.\n"
+            "# TYPE nosh_serve_running gauge\n"
+            "nosh_serve_running %ld\n"
+            "# HELP nosh_serve_completed_total Jobs finished.\n"
+            "# TYPE nosh_serve_completed_total counter\n"
+            "nosh_serve_completed_total %ld\n",
+            serveStats.queued, serveStats.running, serveStats.completed);
+  }
+}
+
+/******************************************************************************
+ * Function:        metricsDump
+ * Description:		called when the dump timer fires, replaces the dump file
+ *					with the current metrics. The file is written beside it
+ *					then renamed so readers never see a partial dump.
+ * Where:			void
+ * Return:			void
+ *****************************************************************************/
+void metricsDump(void) {
+  uint64_t expirations;
+  read(metricsDumpFD, &expirations, sizeof(expirations));
+
+  char tempPath[4096];
+  snprintf(tempPath, sizeof(tempPath), "%s.tmp", metricsDumpPath);
+
+  FILE *out = fopen(tempPath, "w");
+  if (out == NULL) {
+    perror("metrics dump");
+    return;
+  }
+
+  metricsWrite(out);
+
+  if (fclose(out) != 0 || rename(tempPath, metricsDumpPath) != 0) {
+    perror("metrics dump");
+    unlink(tempPath);
+  }
+}
+
+/******************************************************************************
+ * Function:        metricsSetDump
+ * Description:		starts, restarts or stops the periodic metrics dump
+ * Where:			- char *path - the file to dump to, NULL to stop
+ *					- double interval - seconds between dumps
+ * Return:			0 on success or -1 if the file's directory does not
+ *					exist or the timer could not be created
+ *****************************************************************************/
+int metricsSetDump(char *path, double interval) {
+  // resolve the directory now so a later cd doesn't move the dump, the
+  // file itself does not have to exist yet
+  char *absolute = NULL;
+  if (path != NULL) {
+    char *slash = strrchr(path, '/');
+    char *name = slash != NULL ? slash + 1 : path;
+    char *dir = slash == NULL    ? strdup(".")
+                : slash == path ? strdup("/")
+                                : strndup(path, slash - path);
+    char *resolved = realpath(dir, NULL);
+    free(dir);
+
+    if (resolved == NULL || name[0] == '\0') {
+      errno = resolved == NULL ? errno : EISDIR;
+      perror("metrics dump");
+      free(resolved);
+      return -1;
+    }
+
+    absolute = malloc(strlen(resolved) + strlen(name) + 2);
+    sprintf(absolute, "%s/%s", strcmp(resolved, "/") == 0 ? "" : resolved,
+            name);
+    free(resolved);
+  }
+
+  if (metricsDumpFD != -1) {
+    close(metricsDumpFD);
+    metricsDumpFD = -1;
+  }
+  free(metricsDumpPath);
+  metricsDumpPath = NULL;
+
+  if (path == NULL) {
+    return 0;
+  }
+
+  metricsDumpFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (metricsDumpFD == -1) {
+    perror("timerfd_create()");
+    free(absolute);
+    return -1;
+  }
+  metricsDumpPath = absolute;
+
+  // fire every interval from now on
+  setTimer(metricsDumpFD, interval, interval);
+
+  return 0;
+}
+
+/******************************************************************************
+ * Function:        metricsBuiltin
+ * Description:		the metrics builtin. With no arguments prints the metrics,
+ *					metrics --dump FILE [SECONDS] also writes them to FILE
+ *					periodically and metrics --dump off stops that again.
+ * Where:			- procObj* command - the metrics command
+ *					- int *exitStatus - the shell's exit status, set to 1 on
+ *					a usage error
+ * Return:			void
+ *****************************************************************************/
+void metricsBuiltin(struct procObj *command, int *exitStatus) {
+  char **args = command->args;
+  double interval = METRICS_DEFAULT_INTERVAL;
+
+  if (args[1] == NULL) {
+    metricsWrite(stdout);
+    fflush(stdout);
+    *exitStatus = 0;
+  }
+
+  else if (strcmp(args[1], "--dump") == 0 && args[2] != NULL &&
+           strcmp(args[2], "off") == 0 && args[3] == NULL) {
+    metricsSetDump(NULL, 0);
+    *exitStatus = 0;
+  }
+
+  else if (strcmp(args[1], "--dump") == 0 && args[2] != NULL &&
+           (args[3] == NULL ||
+            (parseDuration(args[3], &interval) == 0 && interval > 0 &&
+             args[4] == NULL))) {
+    *exitStatus = metricsSetDump(args[2], interval) == 0 ? 0 : 1;
+  }
 
-	// if the FG_only flag is set to true toggle it to false eand let the user know
-	// the mode has changed.
   else {
-    char *message = "Exiting foreground-only mode\n";
-    write(STDOUT_FILENO, message, 29);
-    FG_only = 0;
+    printf("usage: metrics [--dump FILE [SECONDS] | --dump off] \n");
+    fflush(stdout);
+    *exitStatus = 1;
   }
 }
 
 // Main Loop
-int main(void) {
+int main(int argc, char *argv[]) {
+
+  // --zygote starts the launcher process once signals are set up,
+  // --metrics dumps the metrics builtin's output to a file every 10s and
+  // --serve runs a command server on a unix socket instead of the prompt
+  int useZygote = 0;
+  char *servePath = NULL;
+  char *metricsPath = NULL;
+  int maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--zygote") == 0) {
+      useZygote = 1;
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      servePath = argv[++i];
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      metricsPath = argv[++i];
+    } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc &&
+               atoi(argv[i + 1]) > 0) {
+      maxJobs = atoi(argv[++i]);
+    } else {
+      fprintf(stderr,
+              "usage: %s [--zygote] [--metrics FILE] "
+              "[--serve SOCKET [--jobs N]]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
 
   // instantiate the memory for the input and args array
   char userInput[2048];
@@ -665,7 +3104,7 @@ int main(void) {
   char *prompt = ":";
 
   // linked list to store background processes
-  struct bgProc *bgProcs = createLL();
+  bgProcs = createLL();
 
   // int to store exit status
   int exitStatus = 0;
@@ -687,6 +3126,28 @@ int main(void) {
 
   sigaction(SIGTSTP, &SIGTSTP_action, NULL);
 
+  // ignore SIGTTOU so the shell can take the terminal back from a timed
+  // foreground command, which runs in a process group of its own
+  signal(SIGTTOU, SIG_IGN);
+
+  // start the launcher while our image is still small, if it fails to start
+  // commands are simply forked by the shell as usual
+  if (useZygote) {
+    startZygote(SIGINT_action, SIGTSTP_action);
+  }
+
+  if (metricsPath != NULL) {
+    metricsSetDump(metricsPath, METRICS_DEFAULT_INTERVAL);
+  }
+
+  // a server should still stop on ^C, its commands run in the background
+  if (servePath != NULL) {
+    signal(SIGINT, SIG_DFL);
+    serveMain(servePath, maxJobs > 0 ? maxJobs : 1, SIGINT_action,
+              SIGTSTP_action);
+    exit(1);
+  }
+
   // the main user input loop
   while (1) {
 
@@ -696,9 +3157,15 @@ int main(void) {
     // clear the input buffer and read into it
     memset(userInput, '\0', sizeof(*userInput));
     write(STDOUT_FILENO, prompt, 2);
-
-    // read with fgets to allow spaces
-    fgets(userInput, 2048, stdin);
+    waitForInput(bgProcs, prompt);
+
+    // take the whole line to allow spaces, leaving like exit at the end
+    // of input
+    if (takeLine(userInput, 2048) == 0) {
+      printf("Exiting \n");
+      fflush(stdout);
+      exitShell(bgProcs);
+    }
 
     // check for a comment or blank input
     if (userInput[0] == '#' || userInput[0] == ' ' || userInput[0] == '\n') {
@@ -709,29 +3176,45 @@ int main(void) {
 
     else {
       // make the process Object from the input
-      struct procObj *command = malloc(sizeof(struct procObj));
-      command = createInputObject(userInput);
+      uint64_t parseStart = nowNs();
+      struct procObj *command = createInputObject(userInput);
+      histRecord(&metrics.parse, parseStart);
+
+      // a line that did not parse is not run at all
+      if (command->error != NULL) {
+        fprintf(stderr, "%s\n", command->error);
+        fflush(stderr);
+        exitStatus = 1;
+      }
 
       // exit command
-      if (strcmp(command->command, "exit") == 0) {
+      else if (strcmp(command->command, "exit") == 0) {
         printf("Exiting \n");
         fflush(stdout);
         exitShell(bgProcs);
       }
 
       // status command
-      if (strcmp(command->command, "status") == 0) {
+      else if (strcmp(command->command, "status") == 0) {
         printf("%d \n", exitStatus);
-        continue;
       }
 
-      // execute the command contained in the struct
-      int respPID = executeInput(command, &exitStatus, SIGINT_action, SIGTSTP_action);
+      // metrics command
+      else if (strcmp(command->command, "metrics") == 0) {
+        metricsBuiltin(command, &exitStatus);
+      }
+
+      else {
+        // execute the command contained in the struct
+        int respPID = executeInput(command, &exitStatus, SIGINT_action, SIGTSTP_action);
 
-      // if the PID returned wasn't zero then store it for later termination
-      if (respPID != 0) {
-        addBgProc(bgProcs, respPID);
+        // if the PID returned wasn't zero then store it for later termination
+        if (respPID != 0) {
+          addBgProc(bgProcs, respPID, command->deadline);
+        }
       }
+
+      freeInputObject(command);
     }
   }
   free(bgProcs);